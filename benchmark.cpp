@@ -0,0 +1,127 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+/*
+  Benchmark of extraction and simplification on generated grids:
+
+    contour_benchmark terrain ncols nrows [seed] [e] [threads] [vw] [snap]
+
+  terrain is fractal, cones, plateaus, serpentine or stripes (see synthetic_grid.h). Contours are
+  extracted at every 1 (e_z 0.3) as contour records, simplified with e (default 2), and turned
+  into segments as run does before writing shape files. For each phase the time, throughput and
+  peak memory of the phase is printed, and the metrics of the run are written to benchmark.json.
+  snap (default 1) is passed to read_grid, and the size of the contour records shows the space
+  saved.
+ */
+
+#include <stdio.h>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "io_contours/contour_types.h"
+#include "io_contours/metrics.h"
+#include "io_contours/contour_records.h"
+#include "contour_reader.h"
+#include "contour_simplification.h"
+#include "synthetic_grid.h"
+
+using namespace std;
+using namespace terrastream;
+using namespace tpie::ami;
+
+typedef ranked_labelled_signed_contour_segment rlss;
+
+static const float CONTOUR_INTERVAL = 1.0f;
+static const float E_Z = 0.3f;
+
+// Resets the peak resident memory of the process where supported (Linux).
+void reset_peak_memory() {
+	ofstream out("/proc/self/clear_refs");
+	out << "5" << endl;
+}
+
+// Peak resident memory in kB since reset_peak_memory.
+long peak_memory() {
+	ifstream in("/proc/self/status");
+	string line;
+	while(getline(in, line)) {
+		if(line.compare(0, 6, "VmHWM:") == 0)
+			return atol(line.c_str()+6);
+	}
+	struct rusage usage; // Peak of the process if the above is not supported.
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+// Prints a phase: Seconds, items of the phase per second and peak memory.
+void report(const char *phase, double start, double items, const char *unit) {
+	double s = now()-start;
+	printf("%-10s %9.3f s %14.0f %s/s %10ld kB peak\n", phase, s, s > 0 ? items/s : 0, unit, peak_memory());
+}
+
+// The segments of the simplified contours, as built by run.
+long long to_segments(contour_record_stream &simplified, stream<rlss> &out) {
+	contour_header h;
+	vector<contour_point> points;
+	while(simplified.read(h, points) == NO_ERROR) {
+		for(size_t i = 1; i < points.size(); i++)
+			out.write_item(rlss(points[i-1].x,points[i-1].y,points[i].x,points[i].y,h.z,false,h.label,(int)i-1));
+	}
+	simplified.rewind();
+	return out.stream_len();
+}
+
+int main(int argc, char **argv) {
+	synthetic_grid::terrain t;
+	if(argc < 4 || !synthetic_grid::parse(argv[1], t)) {
+		cerr << "Usage: " << argv[0] << " fractal|cones|plateaus|serpentine|stripes ncols nrows [seed] [e] [threads] [vw] [snap]" << endl;
+		return 1;
+	}
+	int ncols = atoi(argv[2]), nrows = atoi(argv[3]);
+	unsigned int seed = argc > 4 ? atoi(argv[4]) : 1;
+	float e = argc > 5 ? atof(argv[5]) : 2.0f;
+	unsigned int threads = argc > 6 ? atoi(argv[6]) : 0;
+	simplification::algorithm alg = argc > 7 && atoi(argv[7]) ? simplification::VISVALINGAM_WHYATT : simplification::DOUGLAS_PEUCKER;
+	bool snap = argc > 8 ? atoi(argv[8]) != 0 : true;
+	metrics::enable(true);
+
+	printf("%s %dx%d seed %u e %g threads %u %s%s\n", synthetic_grid::name(t), ncols, nrows, seed, e, threads,
+		   alg == simplification::VISVALINGAM_WHYATT ? "VW" : "DP", snap ? " snap" : "");
+	synthetic_grid grid(t, ncols, nrows, seed);
+	contour_record_stream contours, simplified;
+	stream<rlss> out;
+
+	reset_peak_memory();
+	double start = now();
+	contour_reader::read_grid(grid, CONTOUR_INTERVAL, E_Z, contours, true, threads, snap);
+	// Triangles of the bordered grid:
+	report("extract", start, 2.0*(ncols+1)*(nrows+1), "triangles");
+	printf("records %lld bytes, as contour_points %lld bytes\n",
+		   (long long)(contours.contours()*sizeof(contour_header) + contours.records()*sizeof(packed_record)),
+		   (long long)(contours.points()*sizeof(contour_point)));
+
+	reset_peak_memory();
+	start = now();
+	simplification::constrained_dp(e, contours, CONTOUR_INTERVAL, E_Z, simplified, threads, alg);
+	report("simplify", start, contours.points(), "points");
+
+	reset_peak_memory();
+	start = now();
+	long long n = to_segments(simplified, out);
+	report("output", start, n, "segments");
+
+	printf("contours %lld points %lld simplified points %lld\n", (long long)contours.contours(),
+		   (long long)contours.points(), (long long)simplified.points());
+	if(!metrics::write_report("benchmark.json"))
+		cerr << "Could not write benchmark.json" << endl;
+	return 0;
+}
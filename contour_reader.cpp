@@ -5,7 +5,15 @@
 #include <math.h>
 #include "io_contours/contour_types.h"
 #include "io_contours/contours.h"
+#include "io_contours/intersect.h"
+#include "io_contours/metrics.h"
+#include "io_contours/worker_threads.h"
 #include <terrastream/common/nodata.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include "../../terrastream/common/raster_drivers/gdal_grid_reader.h"
 
 //#define DEBUG_CONTOUR_READER
@@ -17,6 +25,8 @@ using namespace std;
 typedef ranked_labelled_signed_contour_segment rlss;
 
 static int BORDER_ELEV = -1;
+static int BAND_ROWS_PER_THREAD = 32; // Rows of the grid triangulated by each worker per band.
+static size_t BAND_MEMORY = 16*1024*1024; // Bytes of the rows, and of the segments, of a band.
 
 inline height_type row(height_type *row, int const x, int const width) {
 	assert(x >=0);
@@ -29,58 +39,96 @@ inline height_type row(height_type *row, int const x, int const width) {
 	return row[x-1];
 }
 
+// Triangle sink writing every triangle to a stream.
+struct triangle_writer {
+	stream<triangle> &tris;
+	triangle_writer(stream<triangle> &t) : tris(t) {}
+	void operator()(triangle const &t) {
+		tris.write_item(t);
+	}
+};
+
+// Triangle sink intersecting every triangle with the contour planes right away.
+// Computes the map_info of the triangles seen. snap is passed to intersect_triangle.
+// O is either a stream or (for worker threads) a segment_buffer.
+template<typename O>
+struct triangle_intersector {
+	O &segs;
+	elev_t gran;
+	float z_diff;
+	bool snap;
+	map_info inf;
+	bool empty;
+	triangle_intersector(O &s, elev_t g, float zd, bool sn) : segs(s), gran(g), z_diff(zd), snap(sn), empty(true) {}
+	void operator()(triangle t) {
+		if(empty) {
+			init_map_info(inf,&t);
+			empty = false;
+		}
+		update_map_info(inf,&t);
+		intersect_triangle(&t,gran,z_diff,segs,snap);
+	}
+	void merge(triangle_intersector<segment_buffer> &o) {
+		if(o.empty)
+			return;
+		if(empty) {
+			inf = o.inf;
+			empty = false;
+			return;
+		}
+		inf.minX = min(inf.minX,o.inf.minX);
+		inf.maxX = max(inf.maxX,o.inf.maxX);
+		inf.minY = min(inf.minY,o.inf.minY);
+		inf.maxY = max(inf.maxY,o.inf.maxY);
+		inf.minZ = min(inf.minZ,o.inf.minZ);
+		inf.maxZ = max(inf.maxZ,o.inf.maxZ);
+	}
+};
+
 // width: non-bordered width.
-void make_triangles(stream<triangle> &tris, 
+template<typename T>
+void make_triangles(T &tris, 
 					height_type *row2, height_type *row1,
 					int const width, int const y) {
 	for (int x = 0; x < width+1; x++) {
 		triangle_point share1(x,y+1,row(row2, x, width));
 		triangle_point share2(x+1,y,row(row1, x+1, width));
 		// lower triangle: diagonal, cw. (opposite)
-		tris.write_item(triangle(triangle_point(x,y,row(row1, x, width)),
-								 share1,share2));
+		tris(triangle(triangle_point(x,y,row(row1, x, width)),
+					  share1,share2));
 		// upper triangle: diagonal, cw.
-		tris.write_item(triangle(triangle_point(x+1,y+1,row(row2, x+1, width)),
-								 share2,share1));
+		tris(triangle(triangle_point(x+1,y+1,row(row2, x+1, width)),
+					  share2,share1));
 	}
 }
 
-// void contour_reader::read_grid(char *file,
-// 							   float const contour_interval,
-// 							   float const e_z,
-// 							   stream<topology_edge>& os_topo,
-// 							   stream<rlss>& os_segs) {
-// 	boost::program_options::variables_map varmap;
-// 	grid_reader<height_type> reader;
-// 	reader.open(file, -9999, varmap);
-// 	read_grid(reader, contour_interval, e_z, os_topo, os_segs);
-// }
-
-void contour_reader::read_grid(grid_reader<height_type> &reader,
-							   float const contour_interval,
-							   float const e_z,
-							   stream<topology_edge>& os_topo,
-							   stream<contour_point>& os_segs) {
-#ifdef DEBUG_CONTOUR_READER
-	cerr << "Starting to read grid from file" << endl;
-#endif
-	os_segs.truncate(0);
-	os_topo.truncate(0);
-	os_segs.seek(0);
-	os_topo.seek(0);
-//	  cerr << "Options: " << reader.get_options() << endl;
-	int width = reader.get_ncols();
-#ifdef DEBUG_CONTOUR_READER
-	cerr << "Width: " << width << endl;
-#endif
+// Writes the boundary edges of the bordered grid with corners (0,0) and (width+1,height).
+// These are the only edges of the triangulation occuring in a single triangle.
+void make_boundary(stream<endpoint_segment> &boundary, int const width, int const height) {
+	for (int x = 0; x < width+1; x++) {
+		boundary.write_item(endpoint_segment(triangle_point(x,0,BORDER_ELEV),
+											 triangle_point(x+1,0,BORDER_ELEV)));
+		boundary.write_item(endpoint_segment(triangle_point(x,height,BORDER_ELEV),
+											 triangle_point(x+1,height,BORDER_ELEV)));
+	}
+	for (int y = 0; y < height; y++) {
+		boundary.write_item(endpoint_segment(triangle_point(0,y,BORDER_ELEV),
+											 triangle_point(0,y+1,BORDER_ELEV)));
+		boundary.write_item(endpoint_segment(triangle_point(width+1,y,BORDER_ELEV),
+											 triangle_point(width+1,y+1,BORDER_ELEV)));
+	}
+}
 
+// Runs the two-row window over the grid, feeding the triangles of every pair of rows to tris.
+// Returns the number of rows in the bordered grid minus one.
+// R is a grid_reader or another source of rows with next_row.
+template<typename R, typename T>
+int triangulate_grid(R &reader, T &tris, int const width) {
 	height_type* row1 = new height_type[width];
 	height_type* row2 = new height_type[width];
 	for (int i = 0; i < width; i++)
 		row2[i]=BORDER_ELEV; // border row.
 
-	stream<triangle> tris;
-
 	int y = 0;
 	bool b = true;
 	while (reader.next_row(b ? row1 : row2)) {
@@ -103,15 +151,279 @@ void contour_reader::read_grid(grid_reader<height_type> &reader,
 	else
 		make_triangles(tris, row2, row1, width, y);
 
-	tris.seek(0);
 	delete []row1;
 	delete []row2;
+	return y+1;
+}
+
+// void contour_reader::read_grid(char *file,
+// 							   float const contour_interval,
+// 							   float const e_z,
+// 							   stream<topology_edge>& os_topo,
+// 							   stream<rlss>& os_segs) {
+// 	boost::program_options::variables_map varmap;
+// 	grid_reader<height_type> reader;
+// 	reader.open(file, -9999, varmap);
+// 	read_grid(reader, contour_interval, e_z, os_topo, os_segs);
+// }
+
+// Triangulates and intersects the row pairs (rows[i],rows[i+1]) for i in [from;to).
+void intersect_band(triangle_intersector<segment_buffer> *intersector,
+					height_type **rows, int const from, int const to,
+					int const width, int const y) {
+	for (int i = from; i < to; i++) {
+		make_triangles(*intersector, rows[i+1], rows[i], width, y+i);
+	}
+}
+
+// The part of a band intersected by one worker.
+struct band_job {
+	triangle_intersector<segment_buffer> *intersector;
+	height_type **rows;
+	int from, to, y;
+};
+
+// Workers of intersect_grid_parallel. They are started once and take the jobs of every band from todo.
+struct band_pool {
+	boost::mutex m;
+	boost::condition_variable cond;
+	deque<band_job> todo;
+	int running; // Jobs taken and not yet done.
+	bool stop;
+	int const width;
+	band_pool(int w) : running(0), stop(false), width(w) {}
 
+	void submit(band_job const &j) {
+		boost::mutex::scoped_lock lock(m);
+		todo.push_back(j);
+		cond.notify_all();
+	}
+	// Waits until all jobs submitted are done.
+	void wait() {
+		boost::mutex::scoped_lock lock(m);
+		while (!todo.empty() || running > 0)
+			cond.wait(lock);
+	}
+	void finish() {
+		boost::mutex::scoped_lock lock(m);
+		stop = true;
+		cond.notify_all();
+	}
+};
+
+// Work of one thread: Intersects jobs until the pool is finished.
+void band_work(band_pool *p) {
+	while (true) {
+		band_job j;
+		{
+			boost::mutex::scoped_lock lock(p->m);
+			while (p->todo.empty() && !p->stop)
+				p->cond.wait(lock);
+			if (p->todo.empty())
+				return;
+			j = p->todo.front();
+			p->todo.pop_front();
+			p->running++;
+		}
+		intersect_band(j.intersector, j.rows, j.from, j.to, p->width, j.y);
+		boost::mutex::scoped_lock lock(p->m);
+		p->running--;
+		p->cond.notify_all();
+	}
+}
+
+// Reads up to band rows into rows after rows[0]. At the end of the grid, a border row is added
+// and last is set. Returns the number of rows in rows.
+template<typename R>
+int read_band(R &reader, height_type **rows, int const band, int const width, bool &last) {
+	int n = 1;
+	while (n < band+1 && reader.next_row(rows[n]))
+		n++;
+	if (n < band+1) {
+		for (int i = 0; i < width; i++)
+			rows[n][i]=BORDER_ELEV; // border row.
+		n++;
+		last = true;
+	}
+	return n;
+}
+
+// Same as triangulate_grid with a triangle_intersector, but reads the grid in horizontal bands and
+// splits every band between the given number of worker threads (see worker_threads.h), which are
+// started once. The next band is read while the workers intersect a band. The segments of each
+// worker are buffered and appended to segs in band order, so segs is the same as for the single
+// threaded version. The rows of the two bands take at most BAND_MEMORY bytes whatever the number
+// of threads. If the segments of a band take more, the bands after the next get fewer rows.
+template<typename R>
+int intersect_grid_parallel(R &reader, 
+							triangle_intersector<stream<signed_contour_segment> > &res,
+							int const width, unsigned int const threads) {
+	size_t const row_bytes = max((size_t)1, width*sizeof(height_type));
+	int const max_band = max(1, min(BAND_ROWS_PER_THREAD*(int)threads, 
+									(int)(BAND_MEMORY/2/row_bytes)-1)); // Row pairs per band.
+	int band = max_band;
+	height_type** rows[2];
+	for (int b = 0; b < 2; b++) {
+		rows[b] = new height_type*[max_band+1];
+		for (int i = 0; i < max_band+1; i++)
+			rows[b][i] = new height_type[width];
+	}
+	for (int i = 0; i < width; i++)
+		rows[0][0][i]=BORDER_ELEV; // border row.
+
+	// The buffers keep their capacity from band to band, so workers seldom allocate.
+	vector<segment_buffer> buffers(threads);
+	vector<triangle_intersector<segment_buffer> > intersectors;
+	intersectors.reserve(threads);
+	band_pool pool(width);
+	boost::thread_group workers;
+	for (unsigned int t = 0; t < threads; t++)
+		workers.create_thread(boost::bind(&band_work, &pool));
+
+	int y = 0;
+	int cur = 0;
+	bool last = false;
+	int n = read_band(reader, rows[cur], band, width, last);
+	while (true) {
+		// Hand out the n-1 row pairs of the band:
+		int const per_thread = (n-1+threads-1)/threads;
+		intersectors.clear();
+		for (unsigned int t = 0; t < threads; t++)
+			intersectors.push_back(triangle_intersector<segment_buffer>(buffers[t], res.gran, res.z_diff, res.snap));
+		for (unsigned int t = 0; t < threads; t++) {
+			band_job j;
+			j.intersector = &intersectors[t];
+			j.rows = rows[cur];
+			j.from = min(n-1, (int)t*per_thread);
+			j.to = min(n-1, j.from+per_thread);
+			j.y = y;
+			if (j.from == j.to)
+				break;
+			pool.submit(j);
+		}
+
+		// Read the next band meanwhile. Its first row is the last row of this band:
+		int next_n = 0;
+		bool next_last = false;
+		if (!last) {
+			copy(rows[cur][n-1], rows[cur][n-1]+width, rows[1-cur][0]);
+			next_n = read_band(reader, rows[1-cur], band, width, next_last);
+		}
+		pool.wait();
+
+		// Merge:
+		size_t segment_bytes = 0;
+		for (unsigned int t = 0; t < threads; t++) {
+			for (segment_buffer::iterator it = buffers[t].begin(); it != buffers[t].end(); ++it)
+				res.segs.write_item(*it);
+			segment_bytes += buffers[t].size()*sizeof(signed_contour_segment);
+			if (buffers[t].capacity()*sizeof(signed_contour_segment) > BAND_MEMORY)
+				segment_buffer().swap(buffers[t]);
+			else
+				buffers[t].clear();
+			res.merge(intersectors[t]);
+		}
+
+		// Keep the segments of the bands to come within BAND_MEMORY:
+		if (segment_bytes > BAND_MEMORY)
+			band = max(1, (int)(band*((double)BAND_MEMORY/segment_bytes)));
+		else if (segment_bytes < BAND_MEMORY/4)
+			band = min(max_band, 2*band);
+
+		y += n-1;
+		if (last)
+			break;
+		cur = 1-cur;
+		n = next_n;
+		last = next_last;
+	}
+	pool.finish();
+	workers.join_all();
+
+	for (int b = 0; b < 2; b++) {
+		for (int i = 0; i < max_band+1; i++)
+			delete []rows[b][i];
+		delete []rows[b];
+	}
+	return y;
+}
+
+template<typename R>
+void read_rows(R &reader,
+			   float const contour_interval,
+			   float const e_z,
+			   contour_record_stream& out,
+			   bool const fused,
+			   unsigned int threads,
+			   bool const snap) {
 #ifdef DEBUG_CONTOUR_READER
-	cerr << "Triangles constructed. Moving on to contour lines"  << endl;
+	cerr << "Starting to read grid from file" << endl;
 #endif
-	compute_contours(tris,contour_interval, e_z, os_segs, os_topo); 
+	out.truncate();
+//	  cerr << "Options: " << reader.get_options() << endl;
+	int width = reader.get_ncols();
+#ifdef DEBUG_CONTOUR_READER
+	cerr << "Width: " << width << endl;
+#endif
+
+	threads = worker_threads(threads);
+
+	if (fused) {
+		stream<signed_contour_segment> segs;
+		triangle_intersector<stream<signed_contour_segment> > intersector(segs, contour_interval, e_z, snap);
+		int height;
+		{
+			metrics::timer t(metrics::EXTRACT);
+			if (threads > 1)
+				height = intersect_grid_parallel(reader, intersector, width, threads);
+			else
+				height = triangulate_grid(reader, intersector, width);
+		}
+
+		stream<endpoint_segment> boundary;
+		make_boundary(boundary, width, height);
+#ifdef DEBUG_CONTOUR_READER
+		cerr << "Triangles intersected. Moving on to contour lines"  << endl;
+#endif
+		metrics::timer t(metrics::CONTOURS);
+		compute_contours(segs, boundary, intersector.inf, contour_interval, out);
+	}
+	else {
+		stream<triangle> tris;
+		triangle_writer writer(tris);
+		{
+			metrics::timer t(metrics::EXTRACT);
+			triangulate_grid(reader, writer, width);
+		}
+		tris.seek(0);
+
+#ifdef DEBUG_CONTOUR_READER
+		cerr << "Triangles constructed. Moving on to contour lines"  << endl;
+#endif
+		metrics::timer t(metrics::CONTOURS);
+		compute_contours(tris,contour_interval, e_z, out, snap); 
+	}
 #ifdef DEBUG_CONTOUR_READER
 	cerr << "Done contour lines"  << endl;
 #endif
 }
+
+void contour_reader::read_grid(grid_reader<height_type> &reader,
+							   float const contour_interval,
+							   float const e_z,
+							   contour_record_stream& out,
+							   bool const fused,
+							   unsigned int threads,
+							   bool const snap) {
+	read_rows(reader, contour_interval, e_z, out, fused, threads, snap);
+}
+
+void contour_reader::read_grid(synthetic_grid &grid,
+							   float const contour_interval,
+							   float const e_z,
+							   contour_record_stream& out,
+							   bool const fused,
+							   unsigned int threads,
+							   bool const snap) {
+	read_rows(grid, contour_interval, e_z, out, fused, threads, snap);
+}
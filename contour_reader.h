@@ -5,10 +5,12 @@
 #define __TEST_CONTOUR_SIMPLIFICATION_CONTOUR_READER_H__
 //#include "app_config.h"
 #include "io_contours/contour_types.h"
+#include "io_contours/contour_records.h"
 #include <tpie/portability.h>
 #include <cstdlib>
 #include <tpie/stream.h>
 #include <terrastream/common/grid_reader.h>
+#include "synthetic_grid.h"
 
 using namespace terrastream;
 using namespace tpie::ami;
@@ -16,10 +18,32 @@ using namespace tpie::ami;
 typedef elev_t height_type;
 
 namespace contour_reader {
+// Extracts the contours of the grid at every contour_interval (and +-e_z).
+// If fused is set, the triangles of the grid are intersected as they are formed from the
+// two-row window instead of going through a temporary triangle stream. The output is the same.
+// A fused read can split the grid into horizontal bands triangulated and intersected by threads
+// worker threads (0: one per core, see io_contours/worker_threads.h). The output does not depend
+// on the number of threads.
+// The contours are written to out as contour records (see io_contours/contour_records.h).
+// If snap is set, the points interpolated on the grid are moved to the nearest point of the
+// lattice of packed_contours.h (by at most 2^-21) as they are computed, so the contours are
+// traced and ordered on the moved points. Points on the lattice take a third of the space of
+// others in contour records. Without snap, the points are kept exactly as interpolated.
 void read_grid(grid_reader<height_type> &reader,
 			   float const contour_interval,
 			   float const e_z,
-			   stream<topology_edge>& os_topo,
-			   stream<contour_point>& os_segs);
+			   contour_record_stream& out,
+			   bool const fused = true,
+			   unsigned int threads = 0,
+			   bool const snap = true);
+
+// As above for a generated grid.
+void read_grid(synthetic_grid &grid,
+			   float const contour_interval,
+			   float const e_z,
+			   contour_record_stream& out,
+			   bool const fused = true,
+			   unsigned int threads = 0,
+			   bool const snap = true);
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_CONTOUR_READER_H__*/
@@ -6,12 +6,23 @@
 //#define DEBUG_RP
  
 #include "io_contours/contour_types.h"
+#include "io_contours/point_index.h"
+#include "io_contours/metrics.h"
+#include "io_contours/contour_records.h"
+#include "io_contours/worker_threads.h"
 #include "contour_simplification.h"
 #include "decomposition.h"
 #include "util.h"
 #include <set>
+#include <algorithm>
+#include <limits>
+#include <iterator>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <deque>
 #include <tpie/queue.h>
+#include <tpie/mm.h>
 
 using namespace std;
 using namespace terrastream;
@@ -29,30 +40,6 @@ typedef pair<xycoord_t,xycoord_t> pt;
 typedef pair<contour_point,contour_point> pt2;
 typedef unsigned int CW_SIZE_T; // The size_t type used throughout the code -- kept as 32-bit to avoid doubling memory usage
 
-// distance between the line segment p1-p2 and the point a.
-double distanceLineToPoint(vector<contour_point> &points, int pp1, int pp2, int pa) {
-	assert(pp1 >= 0);
-	assert(pp2 >= 0);
-	assert(pa >= 0);
-	assert(pp1 < points.size());
-	assert(pp2 < points.size());
-	assert(pa < points.size());
-
-	contour_point a = points[pa];
-	contour_point p1 = points[pp1];
-	contour_point p2 = points[pp2];
-	if (p1.x == p2.x && p1.y == p2.y) {
-		return (a-p1).length();
-	}
-	contour_point dir = p2 - p1;
-	contour_point v = a - p1;
-	assert(dot(dir, dir) != 0);
-	double t = (dot(v, dir) / dot(dir, dir));
-	t = min(max(t, 0.0), 1.0);
-	contour_point p = p1 + dir*t;
-	return (a-p).length();
-}
-
 bool near(contour_point &p, contour_point &i1, contour_point &i2) {
 	return i1.rank <= p.rank && p.rank <= i2.rank;
 }
@@ -249,7 +236,6 @@ bool lines_cross(pt2 const &s1, pt2 const &s2) {
 	return lines_cross(p1, p2, p3, p4);
 }
 
-int cnt_intersections = 0;
 /*bool contains_intersections1(contour &c, contour &original) {
 	contour_point prev1;
 	bool first1 = true;
@@ -281,7 +267,7 @@ int cnt_intersections = 0;
 	return does;
 }//*/
 
-typedef set<lp_seg,sl_cmp> lpsegpset;
+typedef lp_seg_line lpsegpset;
 
 pt2 to_pt2(lp_seg s) {
 	return pt2(s.p1(),s.p2());
@@ -394,20 +380,10 @@ inline bool is_left_of_point(lp_seg &seg, link_point *point) {
 	return other->p.x < point->p.x || (other->p.x == point->p.x && other->p.y < point->p.y);
 }
 
-bool ptr_cmp2(link_point* a, link_point* b) {
-	return *a < *b;
-}
-
-struct ep{
-	pt p;
-	vector<pair<CW_SIZE_T,CW_SIZE_T> > ns; // adjacent point, seg index in contour
-	ep(pt _p) : p(_p) {}
-};
-
 const xycoord_t PI = acos(-1.0);
 
-bool build_eps(vector<ep> &eps, contour &c, int &c1, int &c2) {
-	map<pt,CW_SIZE_T> ep_map; // pt: pair<xycoord_t,xycoord_t>, ep_map: point->index
+bool build_eps(point_index &eps, contour &c, int &c1, int &c2) {
+	eps.clear();
 	for (CW_SIZE_T i=1;i<c.size();i++) {
 		contour_point l = c[i];
 		contour_point prev = c[i-1];
@@ -416,20 +392,11 @@ bool build_eps(vector<ep> &eps, contour &c, int &c1, int &c2) {
 			c2 = i;
 			return false;
 		}
-		pt p1 = pt(prev.x,prev.y);
-		pt p2 = pt(l.x,l.y);
-		for (int j=0;j<2;j++) {
-			pt cur = j==0 ? p1 : p2;
-			if (ep_map.count(cur)==0) {
-				eps.push_back(ep(cur)); // ns not set.
-				ep_map[cur]=eps.size()-1; // set index
-			}
-		}
-		CW_SIZE_T ip1 = ep_map[p1];
-		CW_SIZE_T ip2 = ep_map[p2];
-		eps[ip1].ns.push_back(make_pair(ip2,i));
-		eps[ip2].ns.push_back(make_pair(ip1,i));
+		CW_SIZE_T ip1 = eps.insert(prev.x,prev.y);
+		CW_SIZE_T ip2 = eps.insert(l.x,l.y);
+		eps.add_edge(ip1,ip2,i);
 	}
+	eps.build_adjacency();
 	return true;
 }
 
@@ -438,29 +405,31 @@ bool is_original(contour_point &p1, contour_point &prev) {
 }
 
 //Sort neighbors of nodes of degree > 2 (in clockwise order)
-bool order_points(vector<ep> &eps, contour &c, int &c1, int &c2) {
+bool order_points(point_index &eps, contour &c, int &c1, int &c2) {
 #ifdef DEBUG_CI2
 	if(start_debug()) {
 		cerr << "Starting Check order around points. ||=" << eps.size() << endl;
 	}
 #endif
 	for (CW_SIZE_T i=0;i<eps.size();i++) {
-		if (eps[i].ns.size()>2) {
+		if (eps.degree(i)>2) {
+			point_index::neighbour *ns = eps.neighbours(i);
+			const segment_point &p = eps.point(i);
 #ifdef DEBUG_CI2
 			if(start_debug()) {
-				cerr << "Checking " << i << ": " << eps[i].p.first << "," << eps[i].p.second << " of size " << eps[i].ns.size() << endl;
+				cerr << "Checking " << i << ": " << p.x << "," << p.y << " of size " << eps.degree(i) << endl;
 			}
 #endif
 			vector<xycoord_t> tmp; // cos, index.
 			xycoord_t min_arg = 100000, max_arg = -10000000;
-			for (CW_SIZE_T j=0;j<eps[i].ns.size();j++) {
-				pair<CW_SIZE_T,CW_SIZE_T> n = eps[i].ns[j];
+			for (CW_SIZE_T j=0;j<eps.degree(i);j++) {
+				const segment_point &q = eps.point(ns[j].first);
 #ifdef DEBUG_CI2
 				if(start_debug())
-					cerr << "vs " << n.first << ": " << eps[n.first].p.first << "," << eps[n.first].p.second << endl;
+					cerr << "vs " << ns[j].first << ": " << q.x << "," << q.y << endl;
 #endif
-				xycoord_t dx = eps[n.first].p.first-eps[i].p.first;
-				xycoord_t dy = eps[n.first].p.second-eps[i].p.second;
+				xycoord_t dx = q.x-p.x;
+				xycoord_t dy = q.y-p.y;
 				xycoord_t l = sqrt(dx*dx+dy*dy);
 				dx/=l;
 				xycoord_t acos_r = acos(dx);
@@ -498,8 +467,8 @@ bool order_points(vector<ep> &eps, contour &c, int &c1, int &c2) {
 						continue;
 					}
 				
-					c1 = eps[i].ns[jj].second; 
-					c2 = eps[i].ns[j].second; 
+					c1 = ns[jj].second; 
+					c2 = ns[j].second; 
 					if(is_original(c[c1],c[c1-1]) && is_original(c[c2],c[c2-1])) {
 #ifdef DEBUG_CI2
 						if(start_debug())
@@ -515,7 +484,44 @@ bool order_points(vector<ep> &eps, contour &c, int &c1, int &c2) {
 	return true;
 }
 
-bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
+/*
+  Finds self intersections of a contour. The points are ordered around points of degree > 2 
+  before a sweep over all segments. Once a crossing has been found, the sweep line is kept at 
+  regular events, so that after later fixes check_again only sweeps from the last kept event 
+  before the added segments. Contours without crossings are swept once and keep nothing.
+  A finder is reused for all contours of a cdp_workspace, so its buffers grow only to fit the 
+  longest contour.
+ */
+class crossing_finder {
+public:
+	crossing_finder(point_index &_eps, link_point_arena &_arena) : 
+		eps(_eps), arena(_arena), first_point(NULL), cmp(0, &x), line(cmp), snapshot_every(0), snapshotting(false), resumable(false) {}
+
+	// Returns true and the crossing segments if c intersects itself.
+	bool check(contour &c, pt2 &cross1, pt2 &cross2);
+	// As check, where c is the last checked contour with points added.
+	bool check_again(contour &c, pt2 &cross1, pt2 &cross2);
+private:
+	bool sweep(size_t from, pt2 &cross1, pt2 &cross2);
+
+	point_index &eps;
+	link_point_arena &arena;
+	link_point *first_point;
+	vector<link_point*> events;
+	xycoord_t x;
+	sl_cmp cmp;
+	lp_seg_line line;
+	vector<pair<size_t,lp_seg_line> > snapshots; // Event index, sweep line before the event.
+	size_t snapshot_every;
+	bool snapshotting; // Whether sweep keeps snapshots.
+	bool resumable;
+
+	crossing_finder(const crossing_finder &f);
+	crossing_finder& operator=(const crossing_finder &f);
+};
+
+bool crossing_finder::check(contour &c, pt2 &cross1, pt2 &cross2) {
+	resumable = false;
 #ifdef DEBUG_CI2
 	if(start_debug())
 		cerr << "Starting Contains Intersections 2" << endl;
@@ -535,7 +541,6 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 	if(start_debug())
 		cerr << " cw_ordering tie in starting" << endl;
 #endif
-	vector<ep> eps; // ep: p=pt point, ns=vector(unref neighbour index,seg index in contour)
 	int c1, c2;
 	bool ok = build_eps(eps, c, c1, c2);
 #ifdef DEBUG_CI2
@@ -563,31 +568,40 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 #endif
 		return true;
 	}
-	eps.clear();//*/
 #ifdef DEBUG_CI2
 	if(start_debug())
 		cerr << " cw_ordering tie in clear!" << endl;
 #endif
 
     // Add segs to event queue:
-	set<link_point*,bool(*)(link_point*,link_point*)> pq(ptr_cmp2);
-	link_point *first_point = decomposition::addContourToPQ(pq, c, false);
+	events.clear();
+	arena.clear();
+	first_point = decomposition::addContourToPQ(events, c, false, arena);
 	assert(first_point != NULL);
+	sort(events.begin(), events.end(), lp_ptr_cmp());
+	// check_again relies on the ring holding all points but the closing one:
+	resumable = events.size() == c.size()-1;
+	snapshotting = false;
+	snapshots.clear();
+	line = lp_seg_line(cmp);
 
 #ifdef DEBUG_CI2
 	if(start_debug()) {
-		cerr << "Starting sweep on |PQ| = " << pq.size() << endl;
+		cerr << "Starting sweep on |PQ| = " << events.size() << endl;
 		cerr << "First point: " << *first_point << endl;
-		print_set(pq);
+		print_vector(events);
 		cerr << "---------------------------" << endl;
 	}
 #endif
 	
-	xycoord_t x;
-	sl_cmp sweep_line_cmp(0, &x);
-	lpsegpset sweep_line(sweep_line_cmp);
+	return sweep(0, cross1, cross2);
+}
 
-	for(set<link_point*,bool(*)(link_point*,link_point*)>::iterator it_pq = pq.begin(); it_pq != pq.end();) {
+bool crossing_finder::sweep(size_t from, pt2 &cross1, pt2 &cross2) {
+	for(vector<link_point*>::iterator it_pq = events.begin() + from; it_pq != events.end();) {
+		size_t at = it_pq - events.begin();
+		if(snapshotting && (snapshots.empty() || at >= snapshots.back().first + snapshot_every))
+			snapshots.push_back(make_pair(at, line));
 		link_point *p = *it_pq;
 		x = p->p.x;
 #ifdef DEBUG_CI2
@@ -603,12 +617,12 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 #endif		
 			// Update l/r:
 			bool is_left = is_left_of_point(seg, p);
-			bool fail = update_sweep_line(sweep_line, seg, is_left, cross1, cross2);
+			bool fail = update_sweep_line(line, seg, is_left, cross1, cross2);
 			if(fail) {
 				return true;
 			}
 			contour_point c1,c2,c3,c4;
-			if(sweep_line_cmp.has_assertion_raised(c1, c2, c3, c4)) {
+			if(cmp.has_assertion_raised(c1, c2, c3, c4)) {
 				cross1 = pair<contour_point,contour_point>(c1,c2);
 				cross2 = pair<contour_point,contour_point>(c3,c4);
 				return true;				
@@ -616,18 +630,18 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 
 			seg = lp_seg(p->next);
 			is_left = is_left_of_point(seg, p);
-			fail = update_sweep_line(sweep_line, seg, is_left, cross1, cross2);
+			fail = update_sweep_line(line, seg, is_left, cross1, cross2);
 			if(fail) {
 				return true;
 			}
-			if(sweep_line_cmp.has_assertion_raised(c1, c2, c3, c4)) {
+			if(cmp.has_assertion_raised(c1, c2, c3, c4)) {
 				cross1 = pair<contour_point,contour_point>(c1,c2);
 				cross2 = pair<contour_point,contour_point>(c3,c4);
 				return true;				
 			}
 
 			++it_pq;
-			if(it_pq == pq.end() || !(*p == **it_pq)) {
+			if(it_pq == events.end() || !(*p == **it_pq)) {
 				break;
 			}
 			p = *it_pq;
@@ -637,29 +651,29 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 #ifdef DEBUG_CI2
 		if(start_debug()) {
 			cerr << " Sweep line:" << endl;
-			print_set(sweep_line);
-			if(!sweep_line.empty()) {
-				lp_seg prev = *(sweep_line.begin());
+			print_set(line);
+			if(!line.empty()) {
+				lp_seg prev = *(line.begin());
 				xycoord_t prev_y = prev.eval(x);
-				for(lpsegpset::iterator it_sl = ++sweep_line.begin(); it_sl != sweep_line.end(); ++it_sl) {
+				for(lpsegpset::iterator it_sl = ++line.begin(); it_sl != line.end(); ++it_sl) {
 					lp_seg sl_seg = *it_sl;
 					assert(!lines_cross(prev, sl_seg));
 					if(prev_y > sl_seg.eval(x)) {
 						cerr << " SWEEP LINE INCONSISTENCY x ON: " << sl_seg << " vs prev at y " << prev_y << endl;
 						assert(false);
 					}
-					if(!sweep_line_cmp(prev,sl_seg)) {
+					if(!cmp(prev,sl_seg)) {
 						cerr << " SWEEP LINE INCONSISTENCY x2: " << endl;
-						cerr << "  compare prev,sl_seg: " << sweep_line_cmp(prev,sl_seg) << endl;
-						cerr << "  compare sl_seg,prev: " << sweep_line_cmp(sl_seg,prev) << endl;
+						cerr << "  compare prev,sl_seg: " << cmp(prev,sl_seg) << endl;
+						cerr << "  compare sl_seg,prev: " << cmp(sl_seg,prev) << endl;
 						cerr << prev << endl;
 						cerr << sl_seg << " at y " << prev_y << endl;
 						assert(false);
 					}
-					if(sweep_line_cmp(sl_seg,prev)) {
+					if(cmp(sl_seg,prev)) {
 						cerr << " SWEEP LINE INCONSISTENCY x3 (too late): " << endl;
-						cerr << "  compare prev,sl_seg: " << sweep_line_cmp(prev,sl_seg) << endl;
-						cerr << "  compare sl_seg,prev: " << sweep_line_cmp(sl_seg,prev) << endl;
+						cerr << "  compare prev,sl_seg: " << cmp(prev,sl_seg) << endl;
+						cerr << "  compare sl_seg,prev: " << cmp(sl_seg,prev) << endl;
 						cerr << prev << endl;
 						cerr << sl_seg << " at y " << prev_y << endl;
 						assert(false);
@@ -678,104 +692,747 @@ bool contains_intersections2(contour &c, pt2 &cross1, pt2 &cross2) {
 	return false;
 }
 
-// Douglas Peucker helper method. This method does the actual work of finding the point with the largest distance and recurses.
-int cnt_bail_e = 0, cnt_bail_d = 0;
-int dp(decomposition *d, float e, contour &points, int start, int end, contour *c) {
-	if(start == end-1) {
-		return 0;
-	}
-	assert(points.size() >= end);
-	assert(start >= 0);
-	assert(start < points.size());
-	assert(end > 0);
-	assert(end < points.size()+1);
-	assert(end > start);
-#ifdef DEBUG_SIMPLIFICATION
+/*
+  Checks c again after fix_crossing has added points of the original contour to it. Only 
+  the points are added to the ring, and the sweep is resumed from the last snapshot before 
+  the first change. The first call after check sweeps from the start and takes the snapshots, 
+  so that contours without crossings never pay for them. If a fix touches a point that occurs 
+  more than once, the ordering around points must be checked again, so the whole contour is 
+  checked as by check.
+  This is not an incremental repair: A fix still costs O(n) for finding the added points in 
+  the ring, the order around points and merging the events, and the sweep runs to the next 
+  crossing or the end, as the events after the crossing that stopped the last sweep have not 
+  been checked. What is saved compared to check is sorting the events and, after the first 
+  fix, sweeping the events before the fix.
+ */
+bool crossing_finder::check_again(contour &c, pt2 &cross1, pt2 &cross2) {
+	if(!resumable || !(c.front() == first_point->p) || c.front().rank != first_point->p.rank)
+		return check(c, cross1, cross2);
+	// Points of c not in the ring are new. The closing point is not in the ring:
+	vector<link_point*> added;
+	link_point *lp = first_point->next;
+	for(size_t j = 1; j+1 < c.size(); ++j) {
+		contour_point &q = c[j];
+		if(lp != first_point && lp->p.rank == q.rank && lp->p == q) {
+			lp = lp->next;
+			continue;
+		}
+		if(q == first_point->p) // linkContour would close the ring here.
+			return check(c, cross1, cross2);
+		link_point *n = arena.create(q);
+		link_point *prev = lp->prev;
+		link_point::connect(prev, n);
+		link_point::connect(n, lp);
+		added.push_back(n);
+	}
+	if(lp != first_point || added.empty())
+		return check(c, cross1, cross2);
+
+	// The order around points is checked as by check:
+	int c1, c2;
+	if(!build_eps(eps, c, c1, c2) || !order_points(eps, c, c1, c2))
+		return check(c, cross1, cross2);
+
+	// Events before the first touched segment are handled as before the fix:
+	xycoord_t a = numeric_limits<xycoord_t>::max();
+	for(vector<link_point*>::iterator it = added.begin(); it != added.end(); ++it) {
+		link_point *n = *it;
+		a = min(a, min(n->p.x, min(n->prev->p.x, n->next->p.x)));
+	}
+	size_t bound = 0, hi = events.size();
+	while(bound < hi) {
+		size_t mid = (bound + hi) / 2;
+		if(events[mid]->p.x < a)
+			bound = mid+1;
+		else
+			hi = mid;
+	}
+	sort(added.begin(), added.end(), lp_ptr_cmp());
+	size_t old_size = events.size();
+	events.insert(events.end(), added.begin(), added.end());
+	inplace_merge(events.begin(), events.begin() + old_size, events.end(), lp_ptr_cmp());
+
+	size_t from = 0;
+	if(!snapshotting) { // The first fix:
+		snapshotting = true;
+		snapshot_every = max((size_t)256, events.size() / 32);
+		line = lp_seg_line(cmp);
+	}
+	else {
+		while(snapshots.back().first > bound)
+			snapshots.pop_back();
+		from = snapshots.back().first;
+		line = snapshots.back().second;
+	}
+#ifdef DEBUG_CI2
 	if(start_debug())
-		cerr << "  DP from " << start << " (" << points[start] << ") to " << end-1 << " (" << points[end-1] << ") and e=" << e << endl;
+		cerr << "Resuming sweep at " << from << " of " << events.size() << " for " << added.size() << " new points" << endl;
 #endif
-	// Find largest/max dist:
-	int max = start;
-	double max_dist = -1;
-	for(int i = start+1; i < end; ++i) {			
-		double dist = distanceLineToPoint(points, start, end-1, i);
-		if (dist > max_dist) {
-			max_dist = dist;
-			max = i;
+	return sweep(from, cross1, cross2);
+}
+
+// Counters for constrained_dp. Each family of siblings is counted on its own and added in the end.
+struct cdp_stats {
+	int intersections, max_rd, bail_e, bail_d;
+	int contours_simplified, segs_simplified, segs_simplifiable;
+	int linear_scans, bfs_scans, bfs_steps;
+
+	cdp_stats() : intersections(0), max_rd(0), bail_e(0), bail_d(0), 
+				  contours_simplified(0), segs_simplified(0), segs_simplifiable(0),
+				  linear_scans(0), bfs_scans(0), bfs_steps(0) {}
+
+	void add(const cdp_stats &s) {
+		intersections += s.intersections;
+		max_rd = max(max_rd, s.max_rd);
+		bail_e += s.bail_e;
+		bail_d += s.bail_d;
+		contours_simplified += s.contours_simplified;
+		segs_simplified += s.segs_simplified;
+		segs_simplifiable += s.segs_simplifiable;
+		linear_scans += s.linear_scans;
+		bfs_scans += s.bfs_scans;
+		bfs_steps += s.bfs_steps;
+	}
+
+	void count(metrics::recorder &r) const {
+		r.count("intersections", intersections);
+		r.count("max_crossing_fix_recursion", max_rd);
+		r.count("bail_epsilon", bail_e);
+		r.count("bail_decomposition", bail_d);
+		r.count("contours_simplified", contours_simplified);
+		r.count("segments_simplified", segs_simplified);
+		r.count("segments_simplifiable", segs_simplifiable);
+		r.count("linear_scans", linear_scans);
+		r.count("bfs_scans", bfs_scans);
+		r.count("bfs_steps", bfs_steps);
+	}
+};
+
+static const int DP_BLOCK = 32; // Points per leaf of the hull tree of dp_buffers.
+static const int DP_TREE_SIZE = 4096; // Ranges of at least this many points search the tree.
+
+/*
+  Reusable buffers of dp: The coordinates of the contour as separate arrays, the squared 
+  distances to the current shortcut and the ranges still to simplify.
+
+  For long contours, the convex hulls of blocks of DP_BLOCK points are kept in a complete 
+  binary tree (node 1 is the root and leaf b is node leaves+b), each as its upper and lower 
+  chain from left to right. The distance to the shortcut is convex, so the farthest point of 
+  a node is on its hull. The hull gives the largest distance from the line through the 
+  shortcut and how far the points reach beyond its ends in O(log h) by binary search on the 
+  chains, which bounds the distance of every point of the node. For a node whose points are 
+  all between the perpendiculars through the ends of the shortcut, the bound is its largest 
+  distance. Long ranges search the tree from the node with the largest bound and skip nodes 
+  that cannot hold the farthest point, so a range whose points are between the perpendiculars 
+  takes O(log^2 n) apart from the points as far as the farthest up to rounding. That includes 
+  points along an arc around the shortcut, where DP takes O(n^2) when scanning. Nodes with 
+  points beyond the ends are bounded less tightly and may have to be searched further.
+  The tree takes O(n) time to build, as the chains of a node are merged from those of its 
+  children, and at most two indices per point per level.
+ */
+struct dp_buffers {
+	vector<xycoord_t> xs, ys, d2;
+	vector<pair<int,int> > ranges;
+	int leaves; // 0 when there is no tree.
+	vector<xycoord_t> min_x, max_x, min_y, max_y;
+	// The hull of node is hull[hull_at[node];hull_mid[node][ (upper chain) and 
+	// hull[hull_mid[node];hull_end[node][ (lower chain):
+	vector<int> hull, hull_at, hull_mid, hull_end;
+	double rounding; // Bound on the rounding of the computed distance of a point.
+
+	dp_buffers() : leaves(0), rounding(0) {}
+
+	void load(const contour &points) {
+		xs.resize(points.size());
+		ys.resize(points.size());
+		d2.resize(points.size());
+		double scale = 0;
+		for(size_t i = 0; i < points.size(); ++i) {
+			xs[i] = points[i].x;
+			ys[i] = points[i].y;
+			scale = max(scale, (double)max(fabs(xs[i]), fabs(ys[i])));
+		}
+		rounding = scale * 2e-6;
+		leaves = 0;
+		if(points.size() < (size_t)DP_TREE_SIZE)
+			return;
+		int blocks = (points.size() + DP_BLOCK - 1) / DP_BLOCK;
+		leaves = 1;
+		while(leaves < blocks)
+			leaves *= 2;
+		min_x.assign(2*leaves, numeric_limits<xycoord_t>::max());
+		min_y.assign(2*leaves, numeric_limits<xycoord_t>::max());
+		max_x.assign(2*leaves, -numeric_limits<xycoord_t>::max());
+		max_y.assign(2*leaves, -numeric_limits<xycoord_t>::max());
+		for(size_t i = 0; i < points.size(); ++i) {
+			int node = leaves + i / DP_BLOCK;
+			min_x[node] = min(min_x[node], xs[i]);
+			max_x[node] = max(max_x[node], xs[i]);
+			min_y[node] = min(min_y[node], ys[i]);
+			max_y[node] = max(max_y[node], ys[i]);
 		}
+		for(int node = leaves-1; node > 0; --node) {
+			min_x[node] = min(min_x[2*node], min_x[2*node+1]);
+			max_x[node] = max(max_x[2*node], max_x[2*node+1]);
+			min_y[node] = min(min_y[2*node], min_y[2*node+1]);
+			max_y[node] = max(max_y[2*node], max_y[2*node+1]);
+		}
+		build_hulls();
 	}
-	assert(max < end);
-#ifdef DEBUG_SIMPLIFICATION
-	if(start_debug()) {
-		cerr << "  longest distance to a point on " << points[start] << "->" << points[end-1] << ": " << max_dist << " on " << max << ": " << points[max] << endl;
-		if(d == NULL)
-			cerr << "(d NULL)" << endl;
+
+	/*
+	  Returns the point in ]start;end[ farthest from the segment from start to end-1 and sets 
+	  max_dist to its distance. The result is that of computing the distance of each point 
+	  as contour_point arithmetic does and picking the first point with the largest distance.
+	 */
+	int farthest(int start, int end, double &max_dist) {
+		shortcut s(xs[start], ys[start], xs[end-1], ys[end-1]);
+		if(leaves > 0 && end - start >= DP_TREE_SIZE)
+			return farthest_tree(start+1, end, s, max_dist);
+
+		distances(start+1, end, s);
+		int max = start+1;
+		for(int i = start+2; i < end; ++i) {
+			if(d2[i] > d2[max])
+				max = i;
+		}
+		// Distances are rounded after the square root, so an earlier point can be as far:
+		max_dist = distance(max, s);
+		const xycoord_t bound = d2[max] * (1 - 1e-5);
+		for(int i = start+1; i < max; ++i) {
+			if(d2[i] >= bound && distance(i, s) == max_dist)
+				return i;
+		}
+		return max;
+	}
+
+private:
+	vector<int> chain, merged; // Used by build_hulls.
+
+	struct shortcut {
+		xycoord_t x1, y1, dx, dy;
+		double dd, len;
+		bool is_point;
+
+		shortcut(xycoord_t _x1, xycoord_t _y1, xycoord_t x2, xycoord_t y2) : x1(_x1), y1(_y1), dx(x2-_x1), dy(y2-_y1) {
+			dd = dx*dx + dy*dy;
+			len = sqrt(dd);
+			is_point = dx == 0 && dy == 0;
+		}
+	};
+
+	// Points by x, then y, then index:
+	struct point_cmp {
+		const dp_buffers &buf;
+		point_cmp(const dp_buffers &b) : buf(b) {}
+		bool operator()(int a, int b) const {
+			if(buf.xs[a] != buf.xs[b])
+				return buf.xs[a] < buf.xs[b];
+			if(buf.ys[a] != buf.ys[b])
+				return buf.ys[a] < buf.ys[b];
+			return a < b;
+		}
+	};
+
+	// (b-a)x(c-a):
+	double cross(int a, int b, int c) const {
+		return (xs[b]-xs[a])*(double)(ys[c]-ys[a]) - (ys[b]-ys[a])*(double)(xs[c]-xs[a]);
+	}
+
+	// Appends the upper (sign 1) or lower (sign -1) chain of the points of merged, which are 
+	// sorted by point_cmp, to hull:
+	void add_chain(int sign) {
+		chain.clear();
+		for(size_t i = 0; i < merged.size(); ++i) {
+			int p = merged[i];
+			while(chain.size() >= 2 && sign*cross(chain[chain.size()-2], chain.back(), p) >= 0)
+				chain.pop_back();
+			chain.push_back(p);
+		}
+		hull.insert(hull.end(), chain.begin(), chain.end());
+	}
+
+	// The hulls of the leaves from their points and of the other nodes from those of their children:
+	void build_hulls() {
+		hull.clear();
+		hull_at.assign(2*leaves, 0);
+		hull_mid.assign(2*leaves, 0);
+		hull_end.assign(2*leaves, 0);
+		point_cmp cmp(*this);
+		for(int node = 2*leaves-1; node > 0; --node) {
+			int at = hull.size();
+			hull_at[node] = at;
+			if(node >= leaves) {
+				merged.clear();
+				int from = (node-leaves)*DP_BLOCK;
+				int to = min((int)xs.size(), from+DP_BLOCK);
+				for(int i = from; i < to; ++i)
+					merged.push_back(i);
+				sort(merged.begin(), merged.end(), cmp);
+				add_chain(1);
+				hull_mid[node] = hull.size();
+				add_chain(-1);
+			}
+			else {
+				// The chains of the children are sorted, so they are merged rather than sorted:
+				int l = 2*node, r = 2*node+1;
+				merged.clear();
+				merge(hull.begin()+hull_at[l], hull.begin()+hull_mid[l], 
+					  hull.begin()+hull_at[r], hull.begin()+hull_mid[r], back_inserter(merged), cmp);
+				add_chain(1);
+				hull_mid[node] = hull.size();
+				merged.clear();
+				merge(hull.begin()+hull_mid[l], hull.begin()+hull_end[l], 
+					  hull.begin()+hull_mid[r], hull.begin()+hull_end[r], back_inserter(merged), cmp);
+				add_chain(-1);
+			}
+			hull_end[node] = hull.size();
+		}
+	}
+
+	// Largest value of nx*x+ny*y over the hull of node. The value is unimodal along the upper 
+	// chain if ny >= 0 and along the lower chain if ny <= 0, where the largest value is:
+	double extreme(int node, double nx, double ny) const {
+		int lo = ny >= 0 ? hull_at[node] : hull_mid[node];
+		int hi = (ny >= 0 ? hull_mid[node] : hull_end[node]) - 1;
+		while(lo < hi) {
+			int mid = (lo + hi) / 2;
+			int a = hull[mid], b = hull[mid+1];
+			if(nx*(xs[b]-xs[a]) + ny*(double)(ys[b]-ys[a]) > 0)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		return nx*xs[hull[lo]] + ny*(double)ys[hull[lo]];
+	}
+
+	// Offset from the point closest to i on the shortcut, computed and rounded as for 
+	// contour_point arithmetic.
+	inline void offset(int i, const shortcut &s, xycoord_t &ex, xycoord_t &ey) const {
+		xycoord_t vx = xs[i] - s.x1;
+		xycoord_t vy = ys[i] - s.y1;
+		if(s.is_point) {
+			ex = vx;
+			ey = vy;
+			return;
+		}
+		double t = (vx*s.dx + vy*s.dy) / s.dd;
+		t = min(max(t, 0.0), 1.0);
+		xycoord_t px = s.dx*t;
+		xycoord_t py = s.dy*t;
+		ex = xs[i] - (s.x1 + px);
+		ey = ys[i] - (s.y1 + py);
+	}
+
+	// Squared distances of [from;to[ in one pass.
+	void distances(int from, int to, const shortcut &s) {
+		xycoord_t *dist2 = &d2[0];
+		if(s.is_point) {
+			for(int i = from; i < to; ++i) {
+				xycoord_t vx = xs[i] - s.x1;
+				xycoord_t vy = ys[i] - s.y1;
+				dist2[i] = vx*vx + vy*vy;
+			}
+			return;
+		}
+		for(int i = from; i < to; ++i) {
+			xycoord_t ex, ey;
+			offset(i, s, ex, ey);
+			dist2[i] = ex*ex + ey*ey;
+		}
+	}
+
+	double distance(int i, const shortcut &s) const {
+		xycoord_t ex, ey;
+		offset(i, s, ex, ey);
+		return contour_point(ex, ey, 0, 0).length();
+	}
+
+	/*
+	  Upper bound on the computed distance of the points of node. A point at distance h from 
+	  the line through the shortcut, reaching o beyond its nearest end, is sqrt(h^2+o^2) from 
+	  the shortcut, so the largest h and o of the hull bound all points. A shortcut of a single 
+	  point is bounded by the box of node.
+	 */
+	double bound(int node, const shortcut &s) const {
+		if(hull_at[node] == hull_end[node])
+			return -1; // No points.
+		double max_d2 = 0;
+		if(s.is_point) {
+			for(int corner = 0; corner < 4; ++corner) {
+				double vx = ((corner & 1) ? max_x[node] : min_x[node]) - s.x1;
+				double vy = ((corner & 2) ? max_y[node] : min_y[node]) - s.y1;
+				max_d2 = max(max_d2, vx*vx + vy*vy);
+			}
+		}
+		else {
+			// Cross and dot products with the shortcut relative to its start:
+			double c0 = -s.dy*(double)s.x1 + s.dx*(double)s.y1;
+			double t0 = s.dx*(double)s.x1 + s.dy*(double)s.y1;
+			double h = max(extreme(node, -s.dy, s.dx) - c0, extreme(node, s.dy, -s.dx) + c0) / s.len;
+			double o = max(max(extreme(node, -s.dx, -s.dy) + t0, extreme(node, s.dx, s.dy) - t0 - s.dd), 0.0) / s.len;
+			max_d2 = max(h, 0.0)*max(h, 0.0) + o*o;
+		}
+		return sqrt(max_d2) * (1 + 1e-6) + rounding;
+	}
+
+	int farthest_tree(int lo, int hi, const shortcut &s, double &max_dist) {
+		// The largest squared distance, then the first point as far as the first point with it:
+		xycoord_t best = -1;
+		double root = bound(1, s);
+		search_max(1, root, 0, leaves, lo, hi, s, best);
+		int max = search_first(1, root, 0, leaves, lo, hi, s, best, -1);
+		assert(max != -1);
+		max_dist = distance(max, s);
+		int first = search_first(1, root, 0, leaves, lo, hi, s, best * (1 - 1e-5), max_dist);
+		return first == -1 ? max : first;
+	}
+
+	// Finds the largest squared distance in [lo;hi[ under node covering blocks [from;to[ with 
+	// the bound b:
+	void search_max(int node, double b, int from, int to, int lo, int hi, const shortcut &s, xycoord_t &best) {
+		if(to*DP_BLOCK <= lo || from*DP_BLOCK >= hi || b < sqrt((double)best))
+			return;
+		if(to - from == 1) {
+			int a = max(lo, from*DP_BLOCK);
+			int e = min(hi, to*DP_BLOCK);
+			distances(a, e, s);
+			for(int i = a; i < e; ++i)
+				best = max(best, d2[i]);
+			return;
+		}
+		// The child most likely to hold the farthest point goes first:
+		int mid = (from + to) / 2;
+		double bl = bound(2*node, s), br = bound(2*node+1, s);
+		if(br > bl) {
+			search_max(2*node+1, br, mid, to, lo, hi, s, best);
+			search_max(2*node, bl, from, mid, lo, hi, s, best);
+		}
+		else {
+			search_max(2*node, bl, from, mid, lo, hi, s, best);
+			search_max(2*node+1, br, mid, to, lo, hi, s, best);
+		}
+	}
+
+	// Returns the first point in [lo;hi[ under node (with the bound b) with a squared distance 
+	// of at least min_d2 and the distance dist (any distance if dist is negative) or -1 if none:
+	int search_first(int node, double b, int from, int to, int lo, int hi, const shortcut &s, xycoord_t min_d2, double dist) {
+		if(to*DP_BLOCK <= lo || from*DP_BLOCK >= hi || b < sqrt((double)min_d2))
+			return -1;
+		if(to - from == 1) {
+			int a = max(lo, from*DP_BLOCK);
+			int e = min(hi, to*DP_BLOCK);
+			distances(a, e, s);
+			for(int i = a; i < e; ++i) {
+				if(d2[i] >= min_d2 && (dist < 0 || distance(i, s) == dist))
+					return i;
+			}
+			return -1;
+		}
+		int mid = (from + to) / 2;
+		int res = search_first(2*node, bound(2*node, s), from, mid, lo, hi, s, min_d2, dist);
+		return res != -1 ? res : search_first(2*node+1, bound(2*node+1, s), mid, to, lo, hi, s, min_d2, dist);
 	}
+};
+
+/*
+  Douglas Peucker on points[start;end[ with the points loaded in buf. Ranges are simplified 
+  from a stack in the order of the recursive formulation, so the end points of the accepted 
+  shortcuts are added to c in order. Returns the number of shortcuts.
+ */
+int dp(decomposition *d, float e, contour &points, int start, int end, dp_buffers &buf, contour *c, cdp_stats &stats) {
+	int shortcuts = 0;
+	buf.ranges.clear();
+	buf.ranges.push_back(make_pair(start, end));
+	while(!buf.ranges.empty()) {
+		start = buf.ranges.back().first;
+		end = buf.ranges.back().second;
+		buf.ranges.pop_back();
+		if(start == end-1) {
+			continue;
+		}
+		assert(points.size() >= end);
+		assert(start >= 0);
+		assert(start < points.size());
+		assert(end > 0);
+		assert(end < points.size()+1);
+		assert(end > start);
+#ifdef DEBUG_SIMPLIFICATION
+		if(start_debug())
+			cerr << "  DP from " << start << " (" << points[start] << ") to " << end-1 << " (" << points[end-1] << ") and e=" << e << endl;
+#endif
+		// Find largest/max dist:
+		double max_dist;
+		int max = buf.farthest(start, end, max_dist);
+		assert(max < end);
+#ifdef DEBUG_SIMPLIFICATION
+		if(start_debug()) {
+			cerr << "  longest distance to a point on " << points[start] << "->" << points[end-1] << ": " << max_dist << " on " << max << ": " << points[max] << endl;
+			if(d == NULL)
+				cerr << "(d NULL)" << endl;
+		}
 #endif
 
-	bool ok_contains = max_dist <= e;
-	if(d != NULL && ok_contains) {
-		if (points[start] == points[end-1]) {
+		bool ok_contains = max_dist <= e;
+		if(d != NULL && ok_contains) {
+			if (points[start] == points[end-1]) {
 #ifdef DEBUG_SIMPLIFICATION
-			if(start_debug(points[start])) {
-				cerr << " Split investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
-			}
+				if(start_debug(points[start])) {
+					cerr << " Split investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
+				}
 #endif
-			ok_contains = d->contains_line(points, start, max);
-			if(ok_contains) {
+				ok_contains = d->contains_line(points, start, max);
+				if(ok_contains) {
+#ifdef DEBUG_SIMPLIFICATION
+					if(start_debug(points[start])) {
+						cerr << " Second part " << endl;
+					}
+#endif
+					ok_contains = d->contains_line(points, max, end-1);
+				}
+				if(!ok_contains)
+					stats.bail_d++;
+			} 
+			else if(max < end-1) {
 #ifdef DEBUG_SIMPLIFICATION
 				if(start_debug(points[start])) {
-					cerr << " Second part " << endl;
+					cerr << " Full investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
 				}
 #endif
-				ok_contains = d->contains_line(points, max, end-1);
+				ok_contains = d->contains_line(points, start, end-1);
+				if(!ok_contains)
+					stats.bail_d++;
 			}
-			if(!ok_contains)
-				cnt_bail_d++;
-		} 
-		else if(max < end-1) {
+			else {
 #ifdef DEBUG_SIMPLIFICATION
-			if(start_debug(points[start])) {
-				cerr << " Full investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
-			}
+				if(start_debug(points[start])) {
+					cerr << " No investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
+				}
+#endif
+				bool actually_ok = d->contains_line(points, start, end-1);
+#ifdef DEBUG_SIMPLIFICATION
+				if(start_debug(points[start])) {
+					cerr << " Actually ok: " << actually_ok << endl;
+				}
 #endif
-			ok_contains = d->contains_line(points, start, end-1);
-			if(!ok_contains)
-				cnt_bail_d++;
+			}
 		}
 		else {
+			stats.bail_e++;
+		}
 #ifdef DEBUG_SIMPLIFICATION
-			if(start_debug(points[start])) {
-				cerr << " No investigation, start " << points[start] << ", max " << points[max] << ", end-1: " << points[end-1] << endl;
-			}
+		if(start_debug(points[start]) && ok_contains) {
+			cerr << " OK" << endl;
+		}
 #endif
-			bool actually_ok = d->contains_line(points, start, end-1);
-#ifdef DEBUG_SIMPLIFICATION
-			if(start_debug(points[start])) {
-				cerr << " Actually ok: " << actually_ok << endl;
+
+		if (!ok_contains) {
+			// [start;max] is simplified before [max;end[:
+			buf.ranges.push_back(make_pair(max, end));
+			buf.ranges.push_back(make_pair(start, max+1));
+		} else {
+			contour_point end_point = points[end-1];
+			if(c != NULL) {
+				c->push_back(end_point);
 			}
-#endif
+			shortcuts++;
 		}
 	}
-	else {
-		cnt_bail_e++;
+	return shortcuts;
+}
+
+/*
+  Reusable buffers of vw: The points left in the contour are linked through prev and next. 
+  Points that can be removed are in a binary min heap on their effective area, and pos is 
+  the position of each point in the heap (-1 if not in the heap). err is a bound on the 
+  distance of the points replaced by the shortcut from each point to the next.
+ */
+struct vw_buffers {
+	vector<int> prev, next, pos, heap;
+	vector<double> area, err;
+	vector<link_point*> start; // Where the line from each point starts in the decomposition.
+
+	void load(int size) {
+		prev.resize(size);
+		next.resize(size);
+		start.resize(size);
+		pos.assign(size, -1);
+		area.assign(size, 0);
+		err.assign(size, 0);
+		heap.clear();
+		for(int i = 0; i < size; ++i) {
+			prev[i] = i-1;
+			next[i] = i+1;
+		}
 	}
-#ifdef DEBUG_SIMPLIFICATION
-	if(start_debug(points[start]) && ok_contains) {
-		cerr << " OK" << endl;
+
+	// Ties are broken by position in the contour, so the order of removal is well defined:
+	bool less(int a, int b) const {
+		return area[a] < area[b] || (area[a] == area[b] && a < b);
+	}
+
+	// Inserts i or moves it to its new area.
+	void update(int i, double a) {
+		area[i] = a;
+		if(pos[i] == -1) {
+			pos[i] = heap.size();
+			heap.push_back(i);
+		}
+		sift_down(sift_up(pos[i]));
+	}
+
+	int pop() {
+		int top = heap.front();
+		move(heap.back(), 0);
+		heap.pop_back();
+		pos[top] = -1;
+		if(!heap.empty())
+			sift_down(0);
+		return top;
+	}
+
+private:
+	void move(int i, int to) {
+		heap[to] = i;
+		pos[i] = to;
 	}
+
+	int sift_up(int at) {
+		int i = heap[at];
+		while(at > 0 && less(i, heap[(at-1)/2])) {
+			move(heap[(at-1)/2], at);
+			at = (at-1)/2;
+		}
+		move(i, at);
+		return at;
+	}
+
+	void sift_down(int at) {
+		int i = heap[at];
+		int size = heap.size();
+		while(2*at+1 < size) {
+			int child = 2*at+1;
+			if(child+1 < size && less(heap[child+1], heap[child]))
+				++child;
+			if(!less(heap[child], i))
+				break;
+			move(heap[child], at);
+			at = child;
+		}
+		move(i, at);
+	}
+};
+
+// Twice the signed area of the triangle i, j, k (positive if counter clockwise).
+double signed_area2(dp_buffers &buf, int i, int j, int k) {
+	return (buf.xs[j]-buf.xs[i])*(double)(buf.ys[k]-buf.ys[i]) - (buf.xs[k]-buf.xs[i])*(double)(buf.ys[j]-buf.ys[i]);
+}
+
+// Effective area of the point j between i and k.
+double effective_area(dp_buffers &buf, int i, int j, int k) {
+	return fabs(signed_area2(buf, i, j, k)) / 2;
+}
+
+// Distance of the point j from the segment from i to k.
+double segment_distance(dp_buffers &buf, int i, int j, int k) {
+	double dx = buf.xs[k] - buf.xs[i], dy = buf.ys[k] - buf.ys[i];
+	double vx = buf.xs[j] - buf.xs[i], vy = buf.ys[j] - buf.ys[i];
+	double dd = dx*dx + dy*dy;
+	if(dd > 0) {
+		double t = min(max((vx*dx + vy*dy) / dd, 0.0), 1.0);
+		vx -= dx*t;
+		vy -= dy*t;
+	}
+	return sqrt(vx*vx + vy*vy);
+}
+
+/*
+  Visvalingam-Whyatt on the closed contour points with the points loaded in buf: Points are 
+  removed in order of effective area. The shortcut replacing a point must be within e of the 
+  original points it replaces, as in dp, and be contained in d, and the contour must keep 
+  its orientation, so that its inside stays inside. A point that can not be 
+  removed is tried again when one of its neighbours is removed. The first point is kept, 
+  as are at least three points. The remaining points are added to c after the first point. 
+  Returns the number of points added.
+  The points replaced by the shortcuts from prev to i and from i to next are no farther from 
+  the shortcut from prev to next than their bounds plus the distance of i from it, as the 
+  distance from the new shortcut grows along the old ones from 0 at prev and next to that of 
+  i. Removals within e by this bound take O(logn) apart from the decomposition, and only 
+  larger bounds scan the replaced points as dp would, after which the bound is the distance 
+  found. The result is the same as when always scanning. Each try still checks the 
+  decomposition along the shortcut, and where the bounds exceed e, a point next to a long 
+  run of removed points can still cost O(n^2) in the worst case.
+ */
+int vw(decomposition *d, float e, contour &points, dp_buffers &buf, vw_buffers &vwb, contour *c, cdp_stats &stats) {
+	int size = points.size();
+	assert(size > 0 && points.front() == points.back());
+	vwb.load(size);
+	for(int i = 1; i < size-1; ++i) {
+		vwb.update(i, effective_area(buf, i-1, i, i+1));
+	}
+	// The shortcuts are checked in any order, so the start of each is located by following the 
+	// contour once, as dp would:
+	d->set_guide(NULL);
+	for(int i = 0; i < size-1; ++i) {
+		vwb.start[i] = d->locate(points[i], points[i+1]);
+		if(vwb.start[i] != NULL)
+			d->contains_line(points, i, i+1);
+	}
+	int left = size-1; // Points of the closed contour.
+	double removed_area = 0;
+	double area2 = 0; // Twice the signed area of the contour.
+	for(int i = 1; i < size-2; ++i) {
+		area2 += signed_area2(buf, 0, i, i+1);
+	}
+	const bool ccw = area2 > 0;
+	while(!vwb.heap.empty() && left > 3) {
+		int i = vwb.pop();
+		int prev = vwb.prev[i], next = vwb.next[i];
+#ifdef DEBUG_SIMPLIFICATION
+		if(start_debug(points[i]))
+			cerr << "  VW " << points[i] << " of area " << vwb.area[i] << " from " << points[prev] << " to " << points[next] << endl;
 #endif
-	
-	if (!ok_contains) {
-		int rank_add = dp(d, e, points, start, max+1, c);
-		return rank_add + dp(d, e, points, max, end, c);
-	} else {
-		contour_point end_point = points[end-1];
-		if(c != NULL) {
-			c->push_back(end_point);
+		// The bounds include the rounding of the distances of dp_buffers:
+		double err = max(vwb.err[prev], vwb.err[i]) + segment_distance(buf, prev, i, next) * (1 + 1e-6) + buf.rounding;
+		if(err > e) {
+			double max_dist;
+			buf.farthest(prev, next+1, max_dist);
+			if(max_dist > e) {
+				stats.bail_e++;
+				continue;
+			}
+			err = max_dist + buf.rounding;
+		}
+		// Removing i removes the triangle prev, i, next from the contour:
+		double new_area2 = area2 - signed_area2(buf, prev, i, next);
+		if((new_area2 > 0) != ccw || new_area2 == 0) {
+			stats.bail_d++;
+			continue;
+		}
+		d->set_guide(vwb.start[prev]);
+		if(vwb.start[prev] == NULL || points[prev] == points[next] || !d->contains_line(points, prev, next)) {
+			stats.bail_d++;
+			continue;
 		}
-		return 1;
+		vwb.next[prev] = next;
+		vwb.prev[next] = prev;
+		vwb.err[prev] = err;
+		area2 = new_area2;
+		--left;
+		// Areas do not decrease, so points are removed in order of the area they were removed for:
+		removed_area = max(removed_area, vwb.area[i]);
+		if(prev > 0)
+			vwb.update(prev, max(removed_area, effective_area(buf, vwb.prev[prev], prev, next)));
+		if(next < size-1)
+			vwb.update(next, max(removed_area, effective_area(buf, prev, next, vwb.next[next])));
+	}
+	int added = 0;
+	for(int i = vwb.next[0]; i < size; i = vwb.next[i]) {
+		if(c != NULL)
+			c->push_back(points[i]);
+		added++;
 	}
+	return added;
 }
 
 void remove_pins(contour *c) {
@@ -788,84 +1445,90 @@ void remove_pins(contour *c) {
 		cerr << " Removing pins from contour of size " << c->size() << endl;
 #endif
 
-	contour points;
-	contour::iterator end = --(c->end());
-	for(contour::iterator it = c->begin(); it != end; ++it) {
-		points.push_back(*it);
-	}
-	c->clear();
-
-	contour_point *prev = &(points.front()), *prevprev = &(points.back());
-	contour::iterator it = points.begin();
-	++it;
-	assert(it != points.end());
+	// Kept points are moved to the front of c. Points are read before they are overwritten:
+	size_t size = c->size()-1;
+	contour_point front = c->front(), back = (*c)[size-1];
+	contour_point prev = front, prevprev = back;
+	size_t kept = 0;
 #ifdef DEBUG_RP
 	if(start_debug()) {
-		cerr << " front: " << *prev << endl;
-		cerr << " back: " << *prevprev << endl;
+		cerr << " front: " << prev << endl;
+		cerr << " back: " << prevprev << endl;
 	}
 #endif
 
-	for(; it != points.end(); ++it) {
+	for(size_t i = 1; i < size; ++i) {
+		contour_point p = (*c)[i];
 #ifdef DEBUG_RP
 		if(start_debug())
-			cerr << "  Handling: " << *it << endl;
+			cerr << "  Handling: " << p << endl;
 #endif
-		assert(prevprev != NULL && prev != NULL);
-		if(*prevprev != *it && *prev != *it && *prevprev != *prev) {
-			c->push_back(*prev);	
+		if(prevprev != p && prev != p && prevprev != prev) {
+			(*c)[kept++] = prev;	
 			prevprev = prev;
 		}
 #ifdef DEBUG_RP
 		else if(start_debug())
-			cerr << "  Removing: " << *prev << endl;
+			cerr << "  Removing: " << prev << endl;
 #endif
-		prev = &(*it);		
+		prev = p;		
 	}
-	assert(prevprev != NULL && prev != NULL);
-	if(*prevprev != points.front() && *prev != points.front()) {
-		c->push_back(points.back()); // last point.
+	c->resize(kept);
+	if(prevprev != front && prev != front) {
+		c->push_back(back); // last point.
 	}
 	
 	c->push_back(c->front()); // Cyclic contour.
 }
 
-int fix_crossing2(contour *c, 
-				  contour::iterator &it_o, contour::iterator const &o_end, 
-				  contour::iterator &it_s, contour::iterator const &s_end, pt2 &cross) {
+/*
+  Finds the shortcut cross.second -> cross.first in c from s and the original points replacing 
+  it in orig from o. On return c[s] is cross.second and orig[o;o_end[ replaces it. Returns 
+  the rank of the last point before cross.first in the fixed contour.
+ */
+int fix_crossing2(contour *c, size_t &s, contour &orig, size_t &o, size_t &o_end, pt2 &cross) {
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
 			cerr << "Fixing crossing segment " << cross.first << "," << cross.second << endl;
 #endif
 //	assert(cross.lp1()->p.rank > cross.lp2()->p.rank); No can do!
 	int added = 0;
-	while(it_s != s_end, it_s->rank != cross.second.rank) {
-#ifdef DEBUG_SIMPLIFICATION
-		if(start_debug(*it_s))
-			cerr << "Adding simplified " << *it_s << endl;
-#endif
-		c->push_back(*it_s);
-		added = it_s->rank;
-		++it_s;
+	while((*c)[s].rank != cross.second.rank) {
+		added = (*c)[s].rank;
+		++s;
+		assert(s < c->size());
 	}
-	// Spool it_o
-	while(it_o != o_end && it_o->rank < it_s->rank) {
-		++it_o;
+	// Spool o
+	while(o < orig.size() && orig[o].rank < (*c)[s].rank) {
+		++o;
 	}
-	// add it_o:
-	while(it_o != o_end && it_o->rank != cross.first.rank) {
+	// originals:
+	o_end = o;
+	while(o_end < orig.size() && orig[o_end].rank != cross.first.rank) {
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
-			cerr << "Adding original " << *it_o << endl;
+			cerr << "Adding original " << orig[o_end] << endl;
 #endif
-		c->push_back(*it_o);
-		added = it_o->rank;
-		++it_o;
+		added = orig[o_end].rank;
+		++o_end;
 	}
-	++it_s;
 	return added;
 }
 
+// Replaces (*c)[s] by orig[o;o_end[.
+void replace_by_originals(contour *c, size_t s, contour &orig, size_t o, size_t o_end) {
+	if(o == o_end) {
+		c->erase(c->begin() + s);
+		return;
+	}
+	(*c)[s] = orig[o];
+	c->insert(c->begin() + s + 1, orig.begin() + o + 1, orig.begin() + o_end);
+}
+
+/*
+  Replaces the two crossing shortcuts of c by the original points between their end points. 
+  c is changed in place from the back, so the points of c are not copied. 
+ */
 void fix_crossing(contour *c, contour &orig, pt2 cross1, pt2 cross2) {
 	int start_rank1 = cross1.second.rank;
 	int start_rank2 = cross2.second.rank;
@@ -874,39 +1537,34 @@ void fix_crossing(contour *c, contour &orig, pt2 cross1, pt2 cross2) {
 		swap(cross1,cross2);
 		swap(start_rank1, start_rank2);
 	}
-	// Copy c:
-	contour copy;
-	for(contour::iterator it = c->begin(); it != c->end(); ++it) {
-		copy.push_back(*it);
-	}		
-
-	// Move both to c:
-	c->clear();
-	contour::iterator it_o = orig.begin();
-	contour::iterator it_s = copy.begin();
-	// Fix cross 1:
-	                 fix_crossing2(c, it_o, orig.end(), it_s, copy.end(), cross1);
-	int last_added = fix_crossing2(c, it_o, orig.end(), it_s, copy.end(), cross2);
-
-	while(it_s != copy.end()) {
-		if(it_s->rank > last_added) {
+	size_t s1 = 0, o1 = 0, o1_end;
+	fix_crossing2(c, s1, orig, o1, o1_end, cross1);
+	size_t s2 = s1+1, o2 = o1_end, o2_end;
+	int last_added = fix_crossing2(c, s2, orig, o2, o2_end, cross2);
+
+	// The rest of the simplified points are kept if they are after the last added point:
+	size_t kept = s2+1;
+	for(size_t i = s2+1; i < c->size(); ++i) {
+		if((*c)[i].rank > last_added) {
 #ifdef DEBUG_SIMPLIFICATION
 			if(start_debug())
-				cerr << "Adding rest from simplified " << *it_s << endl;
+				cerr << "Adding rest from simplified " << (*c)[i] << endl;
 #endif
-			c->push_back(*it_s);
+			(*c)[kept++] = (*c)[i];
 		}
-		++it_s;
-	}	
+	}
+	c->resize(kept);
+	replace_by_originals(c, s2, orig, o2, o2_end);
+	replace_by_originals(c, s1, orig, o1, o1_end);
 }
 
-int cnt_rd = 0;
 /*
-  Douglas Peucker for a single contour.
+  Douglas Peucker (or Visvalingam-Whyatt by alg) for a single contour.
+  The points of c must already be loaded in buf, so all levels of a contour share one load.
  */
 // current_contour, e_simplify, &d
-void cdp(contour *c, const float e, decomposition *d,
-		 stream<contour_point> &output_stream) {
+void cdp(contour *c, const float e, algorithm alg, decomposition *d, crossing_finder &finder,
+		 dp_buffers &buf, vw_buffers &vwb, cdp_stats &stats, metrics::recorder &rec, vector<contour_point> &out) {
 	assert(d != NULL);
 	assert(c != NULL);
 #ifdef DEBUG_SIMPLIFICATION
@@ -923,35 +1581,35 @@ void cdp(contour *c, const float e, decomposition *d,
 	// first point:
 	contour_point p = c->front();
 
+	// The original points are moved to points, and c receives the simplified contour:
 	contour points;
-	for(contour::iterator it = c->begin(); it != c->end(); ++it) {
-		points.push_back(*it);
-	}
-	c->clear();
+	points.swap(*c);
 	c->push_back(p);
 	
-	int size = 1+dp(d, e, points, 0, points.size(), c);
+	int size;
+	{
+		metrics::timer t(metrics::CONTOUR, rec);
+		size = 1+(alg == VISVALINGAM_WHYATT ? vw(d, e, points, buf, vwb, c, stats) : dp(d, e, points, 0, points.size(), buf, c, stats));
+	}
 	
+	metrics::timer t(metrics::CROSSINGS, rec);
 	pt2 cross1, cross2;
 	if(size <= 3) {// || contains_intersections1(*c, points)) { // Load old points: // , points
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
 			cerr << "WARNING: Contour too small " << size << "). Reverting. " << endl;
 #endif
-		c->clear();
-		for(contour::iterator it = points.begin(); it != points.end(); ++it) {
-			c->push_back(*it);
-			output_stream.write_item(*it);		
-		}
+		c->swap(points);
+		out.insert(out.end(), c->begin(), c->end());
 	}
-	else if(contains_intersections2(*c, cross1, cross2)) {
+	else if(finder.check(*c, cross1, cross2)) {
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
 			cerr << "WARNING: Contour contains self intersections (size " << size << "). Reverting. " << endl;
 #endif
 		int rd = 0;
 		do {
-			cnt_intersections++;
+			stats.intersections++;
 #ifdef DEBUG_SIMPLIFICATION
 			if(start_debug(cross1.first)) {
 				cerr << "Fixing crossing of" << endl;
@@ -965,20 +1623,25 @@ void cdp(contour *c, const float e, decomposition *d,
 #endif
 			int before_size = c->size();
 			fix_crossing(c, points, cross1, cross2);
+			if(c->size() == before_size) {
+				// The crossing is in the original contour, which is kept as it is:
+				c->swap(points);
+				break;
+			}
 			assert(c->size() > before_size);
-			if(rd > cnt_rd)
-				cnt_rd = rd;
+			if(rd > stats.max_rd)
+				stats.max_rd = rd;
 			++rd;
 		}
-		while(contains_intersections2(*c, cross1, cross2));
+		while(finder.check_again(*c, cross1, cross2));
 
 		for(contour::iterator it = c->begin(); it != c->end(); ++it) {
-			output_stream.write_item(*it);		
+			out.push_back(*it);		
 		}		
 	}//*/
 	else {
 		for(contour::iterator it = c->begin(); it != c->end(); ++it) {
-			output_stream.write_item(*it);	
+			out.push_back(*it);	
 		}
 	}
 	points.clear();
@@ -989,53 +1652,35 @@ void cdp(contour *c, const float e, decomposition *d,
 #endif
 }
 
-void loadParentAndSiblings(int &parent, 
-						   ami::queue<topo> &q_topo, ami::queue<contour_point> &q_segs, 
+void loadParentAndSiblings(int &parent, contour_record_queue &q, 
 						   map<int,topo> &sibling_topos, map<int,contour*> &contours) {
-	assert(!q_topo.is_empty());
-	const topo *t;
-	q_topo.dequeue(&t);
-	parent = t->c;
+	assert(!q.is_empty());
+	contour_header h;
+	contour *c = new contour;
+	q.dequeue(h, *c);
+	parent = h.label;
+	contours.insert(pair<int,contour*>(parent, c));
 #ifdef DEBUG_SIMPLIFICATION
 	if(start_debug())
 		cerr << "Loading Q->M parent and children of parent, parent: " << parent << endl;
 #endif		
 	
-	// Read all sibling topos from queue:
-	while(!q_topo.is_empty()) { 
-		q_topo.peek(&t);
-		if(t->p != parent)
+	// Read all siblings from queue:
+	const contour_header *next;
+	while(!q.is_empty()) { 
+		q.peek(&next);
+		if(next->parent != parent)
 			break;
 
-		q_topo.dequeue(&t);
+		c = new contour;
+		q.dequeue(h, *c);
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
-			cerr << " Q->M: " << *t << endl;
+			cerr << " Q->M: " << h.topo() << ", ||=" << c->size() << endl;
 #endif		
-		sibling_topos.insert(pair<int,topo>(t->c,*t));
-	}
-
-	// load contours (parent, self, siblings):
-	const contour_point *p;
-	contour_point prev;
-	prev.label = parent;
-	int contour_to_write = parent;
-	vector<contour_point> *v = new vector<contour_point>;
-	while(!q_segs.is_empty()) { 
-		q_segs.peek(&p);
-		if(p->label != prev.label && sibling_topos.find(p->label) == sibling_topos.end())
-			break;
-
-		q_segs.dequeue(&p);
-		if(p->label != contour_to_write) {
-			contours.insert(pair<int,vector<contour_point>* >(contour_to_write, v));
-			v = new vector<contour_point>;
-		}
-		v->push_back(*p);				
-		contour_to_write = p->label;
-		prev = *p;
+		sibling_topos.insert(pair<int,topo>(h.label, h.topo()));
+		contours.insert(pair<int,contour*>(h.label, c));
 	}
-	contours.insert(pair<int,vector<contour_point>* >(contour_to_write, v));
 }
 
 void loadChildrenFromStream(topo* &top, contour_point* &cp, int current, stream<topo> &topology,
@@ -1109,222 +1754,568 @@ void loadChildrenFromStream(topo* &top, contour_point* &cp, int current, stream<
 #endif	
 }
 
+// As loadChildrenFromStream, but with the contours read whole from records.
+void loadChildrenFromRecords(int current, contour_record_stream &input,
+							 map<int,topo> &children_topos, map<int,contour*> &contours) {
+	const contour_header *next;
+	while(input.peek(&next) == NO_ERROR && next->parent == current) {
+		contour_header h;
+		contour *c = new contour;
+		input.read(h, *c);
+#ifdef DEBUG_SIMPLIFICATION
+		if(start_debug())
+			cerr << " Records->M " << h.topo() << ", ||=" << c->size() << endl;
+#endif		
+		children_topos.insert(pair<int,topo>(h.label, h.topo()));
+		contours.insert(pair<int,contour*>(h.label, c));
+	}
+}
+
 void toQueues(contour *current_contour, topo current_topo, 
-			  ami::queue<contour_point> &q_segs, 
-			  ami::queue<topo> &q_topo,
-			  map<int,topo> &children_topos, map<int,contour*> &contours,
-			  stream<contour_point> &output) {
+			  contour_record_queue &q, 
+			  map<int,topo> &children_topos, map<int,contour*> &contours) {
 #ifdef DEBUG_SIMPLIFICATION
 	if(start_debug())
-		cerr << "From memory To Q_segs: " << endl;
+		cerr << "From memory To Q: " << endl;
 #endif		
 	if(current_contour != NULL) {
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
-			cerr << " M->Q_segs,out " << current_topo << ", ||=" << current_contour->size();
-#endif		
-		q_topo.enqueue(current_topo);
-		int s = 0;
-		for(contour::iterator it2 = current_contour->begin(); it2 != current_contour->end(); ++it2) {
-			q_segs.enqueue(*it2);
-			s++;
-//			output.write_item(*it2); // TODO: OK?
-		}
-#ifdef DEBUG_SIMPLIFICATION
-		if(start_debug())
-			cerr << " ||=" << s << endl;
+			cerr << " M->Q " << current_topo << ", ||=" << current_contour->size() << endl;
 #endif		
+		q.enqueue(current_topo, *current_contour);
 	}
 	for(map<int,topo>::iterator it2 = children_topos.begin(); it2 != children_topos.end(); ++it2) {
 		int child = it2->first;
-#ifdef DEBUG_SIMPLIFICATION
-		if(start_debug())
-			cerr << " M->Q_segs " << it2->second;
-#endif
-		q_topo.enqueue(it2->second);
 		map<int,contour*>::iterator it = contours.find(child);
 		assert(it != contours.end());
 		current_contour = it->second;
-		int s = 0;
-		for(contour::iterator it3 = current_contour->begin(); it3 != current_contour->end(); ++it3) {
-			q_segs.enqueue(*it3);
-//			output.write_item(*it3); // TODO: OK?
-			s++;
-		}
 #ifdef DEBUG_SIMPLIFICATION
 		if(start_debug())
-			cerr << " ||=" << s << endl;
-#endif		
+			cerr << " M->Q " << it2->second << ", ||=" << current_contour->size() << endl;
+#endif
+		q.enqueue(it2->second, *current_contour);
 		// Unload own children from memory:
 		contours.erase(child);
 		delete current_contour;
 	}
-#ifdef DEBUG_SIMPLIFICATION
-	if(start_debug())
-		cerr << endl;
-#endif		
 }
 
-void simplification::constrained_dp(const float e_simplify,
-									stream<contour_point> &input_segments,
-									stream<topo> &topology,
-									elev_t granularity, float e_granularity,
-									stream<contour_point> &output) {
-#ifdef DEBUG_SIMPLIFICATION
-	if(start_debug()) {
-		cerr << "Topology: " << endl;
-		topo *t, prev(-10,-10,-10);
-		while(topology.read_item(&t) == NO_ERROR) {
-			cerr << " " << *t;
-			assert(prev.p <= t->p);
-			assert(prev.c < t->c);
-			if(is_level_line(t->c_z, granularity, e_granularity))
-				cerr << "(simplifiable)";
-			cerr << endl;
-			prev = *t;
+static const unsigned int CDP_FAMILIES_PER_THREAD = 4; // Families in flight per worker thread.
+static const size_t CDP_BYTES_PER_POINT = 256; // Per level, of a loaded point with its decomposition and buffers.
+
+/*
+  A parent with its siblings and their children. Simplifying the siblings only depends on the 
+  simplified parent, so families are simplified independently of each other.
+ */
+struct cdp_family {
+	int parent;
+	map<int,topo> sibling_topos;
+	map<int,contour*> contours; // Parent and siblings.
+	vector<map<int,topo> > children_topos; // Children of each sibling, in sibling order.
+	vector<map<int,contour*> > children;
+	vector<map<int,contour*> > levels; // Parent and simplified siblings at levels 1.., as contours at level 0.
+	vector<vector<contour_point> > out; // Output of the siblings for each level, in sibling order.
+	cdp_stats stats;
+	size_t points; // Loaded.
+	bool done;
+
+	cdp_family() : parent(-1), points(0), done(false) {}
+	~cdp_family() {
+		for(map<int,contour*>::iterator it = contours.begin(); it != contours.end(); ++it) {
+			delete it->second;
+		}
+		for(size_t k = 0; k < levels.size(); ++k) {
+			for(map<int,contour*>::iterator it = levels[k].begin(); it != levels[k].end(); ++it) {
+				delete it->second;
+			}
+		}
+	}
+
+	// The contour at level k. Siblings which are not simplified are the same at all levels.
+	contour* at_level(int label, size_t k) {
+		if(k > 0) {
+			map<int,contour*>::iterator it = levels[k-1].find(label);
+			if(it != levels[k-1].end())
+				return it->second;
 		}
+		return contours[label];
+	}
+};
+
+// Memory reused by all families simplified on one thread.
+struct cdp_workspace {
+	point_index eps; // For self intersection checks.
+	link_point_arena check_points; // For self intersection checks.
+	crossing_finder finder; // Checks the contours using eps and check_points.
+	vector<link_point_arena*> points; // For the decomposition of each level.
+	dp_buffers dp;
+	vw_buffers vw;
+	metrics::recorder metrics;
+
+	cdp_workspace() : finder(eps, check_points) {}
+	~cdp_workspace() {
+		for(size_t k = 0; k < points.size(); ++k)
+			delete points[k];
+	}
+};
+
+// Loads the contour label from the front of q.
+contour* loadContourFromQueue(int label, contour_record_queue &q) {
+	contour *c = new contour;
+	contour_header h;
+	q.dequeue(h, *c);
+	assert(h.label == label);
+	return c;
+}
+
+/*
+  The input of constrained_dp: Topology and points in streams of their own, or contour records.
+  Children are loaded in the order of the topology.
+ */
+struct cdp_stream_input {
+	stream<topo> &topology;
+	stream<contour_point> &segs;
+	topo *top; // Stream state.
+	contour_point *cp; // Stream state.
+
+	cdp_stream_input(stream<topo> &t, stream<contour_point> &s) : topology(t), segs(s), top(NULL), cp(NULL) {}
+	void loadChildren(int current, map<int,topo> &children_topos, map<int,contour*> &contours) {
+		loadChildrenFromStream(top, cp, current, topology, children_topos, segs, contours);
+	}
+	void rewind() {
+		segs.seek(0);
 		topology.seek(0);
 	}
-#endif
+	TPIE_OS_OFFSET contours() { return topology.stream_len(); }
+	TPIE_OS_OFFSET points() { return segs.stream_len(); }
+};
 
-	ptime t_all, t_parent;
-	t_all=t_parent=microsec_clock::local_time();
+struct cdp_record_input {
+	contour_record_stream &in;
 
-	//Prepare
-	output.truncate(0);
+	cdp_record_input(contour_record_stream &i) : in(i) {}
+	void loadChildren(int current, map<int,topo> &children_topos, map<int,contour*> &contours) {
+		loadChildrenFromRecords(current, in, children_topos, contours);
+	}
+	void rewind() { in.rewind(); }
+	TPIE_OS_OFFSET contours() { return in.contours(); }
+	TPIE_OS_OFFSET points() { return in.points(); }
+};
 
-	cerr << "------------ Done initial setup ------------ " << endl;
-	double millis = (microsec_clock::local_time()-t_parent).total_milliseconds();
-	cout << millis << " ms." << endl;
-	t_parent=microsec_clock::local_time();
+// The output of constrained_dp for each level: Points or contour records.
+struct cdp_stream_output {
+	vector<stream<contour_point>*> &outputs;
 
-	// Queues:
-	ami::queue<topo> q_topo; // enqueue(T), dequeue(**T), peek(**T)
-	ami::queue<contour_point> q_segs; // Move queues together!
-
-	// Current state:
-	int parent = -1;
-	map<int,topo> sibling_topos; // sibling(or self) -> topo
-	map<int,contour*> contours; // contour label -> points.
-	contour_point *cp = NULL; // input stream state.
-	topo *top = NULL; // input strem state.
-
-	// Put -1 children from stream to Q.
-	q_topo.enqueue(topo(-1,-2,-1.85230002));
-	loadChildrenFromStream(top, cp, -1, topology, sibling_topos, input_segments, contours);
-	toQueues(NULL, *top, q_segs, q_topo, sibling_topos, contours, output);
-
-	int cnt_contours_simplified = 0; // OK
-//	int cnt_segs_all = 0;
-	int cnt_segs_simplified = 0; // OK
-	int cnt_segs_simplifiable = 0; // OK
-	int linear_scans = 0, bfs_scans = 0, bfs_steps = 0;
+	cdp_stream_output(vector<stream<contour_point>*> &o) : outputs(o) {}
+	void write(size_t k, const topo &, const contour_point *points, size_t n) {
+		outputs[k]->write_array(points, n);
+	}
+	void truncate() {
+		for(size_t k = 0; k < outputs.size(); ++k)
+			outputs[k]->truncate(0);
+	}
+	void rewind() {
+		for(size_t k = 0; k < outputs.size(); ++k)
+			outputs[k]->seek(0);
+	}
+	TPIE_OS_OFFSET points(size_t k) { return outputs[k]->stream_len(); }
+};
 
-	// read t => t.p.p and siblings on queue, t.p to be simplified, read t.c.
-	while(!q_topo.is_empty()) { // handle all siblings in an iteration. Break when Q is empty.
+struct cdp_record_output {
+	vector<contour_record_stream*> &outputs;
+
+	cdp_record_output(vector<contour_record_stream*> &o) : outputs(o) {}
+	void write(size_t k, const topo &t, const contour_point *points, size_t n) {
+		outputs[k]->write(t, points, n);
+	}
+	void truncate() {
+		for(size_t k = 0; k < outputs.size(); ++k)
+			outputs[k]->truncate();
+	}
+	void rewind() {
+		for(size_t k = 0; k < outputs.size(); ++k)
+			outputs[k]->rewind();
+	}
+	TPIE_OS_OFFSET points(size_t k) { return outputs[k]->points(); }
+};
+
+// Loads the next family from the queue and the children of its siblings from the input.
+// q_levels holds the simplified parents of levels 1.. in the order of q.
+template<class Input>
+cdp_family* loadFamily(Input &input, contour_record_queue &q, vector<contour_record_queue*> &q_levels) {
 #ifdef DEBUG_SIMPLIFICATION
-		if(start_debug())
-			cerr << "------------------------------------------------------" << endl;
+	if(start_debug())
+		cerr << "------------------------------------------------------" << endl;
 #endif		
+	cdp_family *f = new cdp_family();
+	loadParentAndSiblings(f->parent, q, f->sibling_topos, f->contours);
+	f->levels.resize(q_levels.size());
+	f->out.resize(q_levels.size()+1);
+	if(f->parent != -1) {
+		for(size_t k = 0; k < q_levels.size(); ++k) {
+			f->levels[k][f->parent] = loadContourFromQueue(f->parent, *q_levels[k]);
+		}
+	}
+	f->children_topos.resize(f->sibling_topos.size());
+	f->children.resize(f->sibling_topos.size());
+	int i = 0;
+	for(map<int,topo>::iterator it = f->sibling_topos.begin(); it != f->sibling_topos.end(); ++it, ++i) {
+		input.loadChildren(it->second.c, f->children_topos[i], f->children[i]);
+	}
+	for(map<int,contour*>::iterator it = f->contours.begin(); it != f->contours.end(); ++it)
+		f->points += it->second->size();
+	for(size_t k = 0; k < f->levels.size(); ++k) {
+		for(map<int,contour*>::iterator it = f->levels[k].begin(); it != f->levels[k].end(); ++it)
+			f->points += it->second->size();
+	}
+	for(size_t j = 0; j < f->children.size(); ++j) {
+		for(map<int,contour*>::iterator it = f->children[j].begin(); it != f->children[j].end(); ++it)
+			f->points += it->second->size();
+	}
+	return f;
+}
 
-		// Clear all:
-		sibling_topos.clear();
-		for(map<int,contour*>::iterator it = contours.begin(); it != contours.end(); ++it) {
-			delete it->second;
+// Simplifies the siblings of a family one by one, as each must respect the siblings before it.
+// Every level has its own decomposition, as the parent and the siblings before differ by level.
+void simplifyFamily(cdp_family *f, const vector<float> &e_levels, algorithm alg, elev_t granularity, float e_granularity, cdp_workspace &ws) {
+	metrics::timer t(metrics::FAMILY, ws.metrics);
+	size_t levels = e_levels.size();
+	while(ws.points.size() < levels)
+		ws.points.push_back(new link_point_arena());
+
+	// One decomposition for all siblings per level. The last simplified sibling is restored 
+	// (its children replaced by its simplified self) before the next is masked out:
+	vector<decomposition*> d(levels, (decomposition*)NULL);
+	int restore = -1;
+	vector<int> restore_children;
+
+	// handle all sibling:
+	int i = 0;
+	for(map<int,topo>::iterator it = f->sibling_topos.begin(); it != f->sibling_topos.end(); ++it, ++i) {
+		int current = it->second.c;
+		elev_t current_z = it->second.c_z;
+		bool simplifyable = is_level_line(current_z, granularity, e_granularity) && f->parent != -1;
+#ifdef DEBUG_SIMPLIFICATION
+		if(start_debug()) {
+			cerr << "Handling sibling " << it->first << " at topo:" << it->second << endl;
+			if(simplifyable)
+				cerr << "(Simplifiable)" << endl;
 		}
-		contours.clear();
-		assert(contours.empty());
-		// Load parent and siblings from topo queue:
-		loadParentAndSiblings(parent, q_topo, q_segs, sibling_topos, contours);
+#endif		
+		// Children are in memory while their parent is simplified:
+		map<int,contour*> &children = f->children[i];
+		f->contours.insert(children.begin(), children.end());
+
+		map<int,contour*>::iterator it3 = f->contours.find(current);
+		assert(it3 != f->contours.end());
+		contour *current_contour = it3->second;
+
+		if(simplifyable) {
+			// Actually simplify t->p.
+			{
+				metrics::timer t_d(metrics::DECOMPOSITION, ws.metrics);
+				for(size_t k = 0; k < levels; ++k) {
+					if(d[k] == NULL) {
+						map<int,contour*> in(f->contours);
+						if(k > 0)
+							in[f->parent] = f->levels[k-1][f->parent];
+						d[k] = new decomposition(f->parent, current, in, *ws.points[k]);
+					}
+					else {
+						map<int,contour*> in;
+						in[restore] = f->at_level(restore, k);
+						d[k]->replace(restore_children, in);
+						d[k]->replace(vector<int>(1, current), children);
+					}
+				}
+			}
+			restore = current;
+			restore_children.clear();
+			for(map<int,contour*>::iterator it4 = children.begin(); it4 != children.end(); ++it4) {
+				restore_children.push_back(it4->first);
+			}
+			f->stats.segs_simplifiable += current_contour->size();
+
+			// The original points are loaded once for all levels. The coarser levels 
+			// simplify copies, as cdp changes the contour:
+			ws.dp.load(*current_contour);
+			for(size_t k = levels-1; k > 0; --k) {
+				contour *c = new contour(*current_contour);
+				cdp(c, e_levels[k], alg, d[k], ws.finder, ws.dp, ws.vw, f->stats, ws.metrics, f->out[k]);
+				f->levels[k-1][current] = c;
+			}
+			cdp(current_contour, e_levels[0], alg, d[0], ws.finder, ws.dp, ws.vw, f->stats, ws.metrics, f->out[0]); // current contour is changed.
 #ifdef DEBUG_SIMPLIFICATION
-		if(start_debug())
-			cerr << endl;
+			if(start_debug())
+				cerr << "Simplified " << current << endl;
 #endif		
-		millis = (microsec_clock::local_time()-t_parent).total_milliseconds();
-		cout << endl << "Parent " << parent << ": pre: " << millis << "ms. ";
-			
-		ptime t_child=microsec_clock::local_time();						
+			for(size_t k = 0; k < levels; ++k) {
+				f->stats.linear_scans += d[k]->linear_scans;
+				f->stats.bfs_scans += d[k]->bfs_scans;
+				f->stats.bfs_steps += d[k]->bfs_steps;
+			}
+			f->stats.segs_simplified += current_contour->size();
+			f->stats.contours_simplified++;
+		}
+		else {
+			for(size_t k = 0; k < levels; ++k) {
+				f->out[k].insert(f->out[k].end(), current_contour->begin(), current_contour->end());
+			}
+		}
 
-		// handle all sibling:
-		for(map<int,topo>::iterator it = sibling_topos.begin(); it != sibling_topos.end(); ++it) {
-			int current = it->second.c;
-			elev_t current_z = it->second.c_z;
-			bool simplifyable = is_level_line(current_z, granularity, e_granularity) && parent != -1;
-#ifdef DEBUG_SIMPLIFICATION
-			if(start_debug()) {
-				cerr << "Handling sibling " << it->first << " at topo:" << it->second << endl;
-				if(simplifyable)
-					cerr << "(Simplifiable)" << endl;
+		for(map<int,contour*>::iterator it4 = children.begin(); it4 != children.end(); ++it4) {
+			f->contours.erase(it4->first);
+		}
+	}
+	for(size_t k = 0; k < levels; ++k) {
+		delete d[k];
+	}
+}
+
+// Writes the output of a simplified family for each level, contour by contour, and puts the 
+// (simplified) siblings and their children on the queue. The siblings of levels 1.. go on q_levels,
+// as they are only needed as parents.
+template<class Output>
+void writeFamily(cdp_family *f, contour_record_queue &q, vector<contour_record_queue*> &q_levels, Output &output) {
+	for(size_t k = 0; k < f->out.size(); ++k) {
+		vector<contour_point> &out = f->out[k];
+		size_t j = 0;
+		for(map<int,topo>::iterator it = f->sibling_topos.begin(); it != f->sibling_topos.end(); ++it) {
+			size_t from = j;
+			while(j < out.size() && out[j].label == it->second.c)
+				++j;
+			assert(j > from);
+			output.write(k, it->second, &out[from], j-from);
+		}
+		assert(j == out.size());
+	}
+	int i = 0;
+	for(map<int,topo>::iterator it = f->sibling_topos.begin(); it != f->sibling_topos.end(); ++it, ++i) {
+		contour *current_contour = f->contours[it->second.c];
+		toQueues(current_contour, it->second, q, f->children_topos[i], f->children[i]);
+		for(size_t k = 0; k < q_levels.size(); ++k) {
+			q_levels[k]->enqueue(it->second, *f->at_level(it->second.c, k+1));
+		}
+	}
+}
+
+// State shared by the main thread and the workers of constrained_dp.
+struct cdp_pipeline {
+	boost::mutex m;
+	boost::condition_variable cond;
+	deque<cdp_family*> todo; // Families not yet taken by a worker.
+	bool load_done;
+	const vector<float> &e_levels;
+	algorithm alg;
+	elev_t granularity;
+	float e_granularity;
+	metrics::recorder metrics; // Of the workers that are done.
+
+	cdp_pipeline(const vector<float> &e, algorithm a, elev_t g, float e_g) : load_done(false), e_levels(e), alg(a), granularity(g), e_granularity(e_g) {}
+};
+
+// Worker: Simplifies one family at a time.
+void cdp_work(cdp_pipeline *p) {
+	cdp_workspace ws;
+	while(true) {
+		cdp_family *f;
+		{
+			boost::mutex::scoped_lock lock(p->m);
+			while(p->todo.empty() && !p->load_done)
+				p->cond.wait(lock);
+			if(p->todo.empty()) {
+				p->metrics.add(ws.metrics);
+				return;
 			}
-#endif		
-				
-			// Load children contours from stream (to queue after simplified self):
-			map<int,topo> children_topos;
-			loadChildrenFromStream(top, cp, current, topology, children_topos, input_segments, contours);
+			f = p->todo.front();
+			p->todo.pop_front();
+		}
+		simplifyFamily(f, p->e_levels, p->alg, p->granularity, p->e_granularity, ws);
+		boost::mutex::scoped_lock lock(p->m);
+		f->done = true;
+		p->cond.notify_all();
+	}
+}
 
-			map<int,contour*>::iterator it3 = contours.find(current);
-			assert(it3 != contours.end());
-			contour *current_contour = it3->second;
+// constrained_dp on any input and output.
+template<class Input, class Output>
+void cdp_run(const vector<float> &e_levels, Input &input, elev_t granularity, float e_granularity,
+			 Output &output, unsigned int threads, algorithm alg) {
+	assert(!e_levels.empty());
+	ptime t_all=microsec_clock::local_time();
+	metrics::timer t_simplify(metrics::SIMPLIFY);
 
-			millis = (microsec_clock::local_time()-t_child).total_milliseconds();
-			cout << endl << " Child " << current << " load: " << millis << "ms. ";
-			t_child=microsec_clock::local_time();					
+	//Prepare
+	output.truncate();
 
+	// Queues:
+	contour_record_queue q; // Topology and points together. Packed, as most of the I/O of simplification is here.
+	vector<contour_record_queue*> q_levels; // Simplified siblings of levels 1.. to become parents.
+	for(size_t k = 1; k < e_levels.size(); ++k)
+		q_levels.push_back(new contour_record_queue());
+
+	// Put -1 children from input to Q.
+	{
+		map<int,topo> sibling_topos; // sibling(or self) -> topo
+		map<int,contour*> contours; // contour label -> points.
+		topo root(-1,-2,-1.85230002);
+		q.enqueue(root, contour());
+		input.loadChildren(-1, sibling_topos, contours);
+		toQueues(NULL, root, q, sibling_topos, contours);
+	}
 
-			if(simplifyable) {
-				// Actually simplify t->p.
-				decomposition d(parent, current, contours);
-				cnt_segs_simplifiable += current_contour->size();
-				millis = (microsec_clock::local_time()-t_child).total_milliseconds();
-				cout << "decomp: " << millis << "ms. ";
-				t_child=microsec_clock::local_time();					
+	// Families are loaded and written in the order of the queues by this thread, while workers 
+	// simplify them. The output does not depend on the number of threads.
+	// The families in flight are bounded by count and by the points that fit in the memory left 
+	// to TPIE. Every level keeps a decomposition and a simplified copy of the points of a family, 
+	// so a point counts once per level. One family is loaded whatever its size. Workers and this thread allocate freely, 
+	// which worker_threads only allows when TPIE locks its memory accounting.
+	threads = worker_threads(threads);
+	cdp_pipeline p(e_levels, alg, granularity, e_granularity);
+	boost::thread_group workers;
+	if(threads > 1) {
+		for(unsigned int i = 0; i < threads; i++)
+			workers.create_thread(boost::bind(&cdp_work, &p));
+	}
+	size_t max_inflight = threads == 1 ? 1 : CDP_FAMILIES_PER_THREAD*threads;
+	size_t max_inflight_points = MM_manager.memory_available()/(CDP_BYTES_PER_POINT*e_levels.size());
+	size_t inflight_points = 0;
+	deque<cdp_family*> inflight; // All families not yet written, in load order.
+	cdp_workspace ws; // Used when not using workers.
+	cdp_stats stats;
 
-				cdp(current_contour, e_simplify, &d, output); // current contour is changed.
-#ifdef DEBUG_SIMPLIFICATION
-				if(start_debug())
-					cerr << "Simplified " << current << endl;
-#endif		
-				linear_scans += d.linear_scans;
-				bfs_scans += d.bfs_scans;
-				bfs_steps += d.bfs_steps;
-				cnt_segs_simplified += current_contour->size();
-				millis = (microsec_clock::local_time()-t_child).total_milliseconds();
-				cout << "simp: " << millis << "ms. ";
-				t_child=microsec_clock::local_time();					
-				cnt_contours_simplified++;
+	// read t => t.p.p and siblings on queue, t.p to be simplified, read t.c.
+	while(true) {
+		if(!q.is_empty() && inflight.size() < max_inflight && 
+		   (inflight.empty() || inflight_points < max_inflight_points)) {
+			cdp_family *f;
+			{
+				metrics::timer t(metrics::FAMILY_LOAD);
+				f = loadFamily(input, q, q_levels);
+			}
+			inflight.push_back(f);
+			inflight_points += f->points;
+			if(threads == 1) {
+				simplifyFamily(f, e_levels, alg, granularity, e_granularity, ws);
+				f->done = true;
 			}
 			else {
-				for(contour::iterator it6 = current_contour->begin(); it6 != current_contour->end(); ++it6) {
-					output.write_item(*it6);		
-				}		
+				boost::mutex::scoped_lock lock(p.m);
+				p.todo.push_back(f);
+				p.cond.notify_all();
 			}
-
-			// INSERT (simplified) self and children INTO Queues (topo queue already done):
-			toQueues(current_contour, it->second, q_segs, q_topo, children_topos, contours, output);
-			millis = (microsec_clock::local_time()-t_child).total_milliseconds();
-			cout << "write: " << millis << "ms. ";
-			t_child=microsec_clock::local_time();					
+			continue;
+		}
+		if(inflight.empty())
+			break; // Queues are empty and all is written.
+
+		cdp_family *f = inflight.front();
+		{
+			boost::mutex::scoped_lock lock(p.m);
+			while(!f->done)
+				p.cond.wait(lock);
 		}
-		millis = (microsec_clock::local_time()-t_parent).total_milliseconds();
-		cout << endl << "Total: " << millis << "ms. ";
-		t_parent=microsec_clock::local_time();					
+		inflight.pop_front();
+		inflight_points -= f->points;
+		// INSERT (simplified) siblings and children INTO Queues:
+		{
+			metrics::timer t(metrics::FAMILY_WRITE);
+			writeFamily(f, q, q_levels, output);
+		}
+		stats.add(f->stats);
+		delete f;
+	}
+	{
+		boost::mutex::scoped_lock lock(p.m);
+		p.load_done = true;
+		p.cond.notify_all();
 	}
+	workers.join_all();
+	metrics::global().add(p.metrics);
+	metrics::global().add(ws.metrics);
+	for(size_t k = 0; k < q_levels.size(); ++k)
+		delete q_levels[k];
 
 	// TODO: Update paper with BFS and selv in queue?			
-	input_segments.seek(0);
-	topology.seek(0);
-	output.seek(0);
-	cout << endl;
+	input.rewind();
+	output.rewind();
+	if(metrics::enabled())
+		stats.count(metrics::global());
 	cout << " Time usage for cdp in total: " << (microsec_clock::local_time()-t_all) << " ms." << endl;
-	cout << "|topology| (stream len): " << topology.stream_len() << endl;
-	cout << "#|All contours| (stream len): " << input_segments.stream_len()-topology.stream_len() << endl;
-	cout << "#|simplifiable segments|: " << cnt_segs_simplifiable << endl;
-	cout << "#|simplified segments|: " << cnt_segs_simplified << endl;
-	cout << "#|output segments| (stream len): " << output.stream_len()-topology.stream_len() << endl;
-	cout << "#Intersections: " << cnt_intersections << endl;
-    cout << "#Max recursion for fixing crossings: " << cnt_rd << endl;
-    cout << "#Extra linear scans: " << linear_scans << endl;
-    cout << "#BFS scans and steps: " << bfs_scans << ", " << bfs_steps << endl;
-    cout << "#bail for epsilon: " << cnt_bail_e << endl;
-    cout << "#bail for decomposition: " << cnt_bail_d << endl;
+	cout << "|topology| (stream len): " << input.contours() << endl;
+	cout << "#|All contours| (stream len): " << input.points()-input.contours() << endl;
+	cout << "#|simplifiable segments|: " << stats.segs_simplifiable << endl;
+	cout << "#|simplified segments|: " << stats.segs_simplified << endl;
+	cout << "#|output segments| (stream len): " << output.points(0)-input.contours() << endl;
+	for(size_t k = 1; k < e_levels.size(); ++k)
+		cout << "#|output segments| at e=" << e_levels[k] << " (stream len): " << output.points(k)-input.contours() << endl;
+	cout << "#Intersections: " << stats.intersections << endl;
+    cout << "#Max recursion for fixing crossings: " << stats.max_rd << endl;
+    cout << "#Extra linear scans: " << stats.linear_scans << endl;
+    cout << "#BFS scans and steps: " << stats.bfs_scans << ", " << stats.bfs_steps << endl;
+    cout << "#bail for epsilon: " << stats.bail_e << endl;
+    cout << "#bail for decomposition: " << stats.bail_d << endl;
+}
+
+void simplification::constrained_dp(const float e_simplify,
+									stream<contour_point> &input_segments,
+									stream<topo> &topology,
+									elev_t granularity, float e_granularity,
+									stream<contour_point> &output,
+									unsigned int threads,
+									algorithm alg) {
+	vector<stream<contour_point>*> outputs(1, &output);
+	constrained_dp(vector<float>(1, e_simplify), input_segments, topology, granularity, e_granularity, outputs, threads, alg);
+}
+
+void simplification::constrained_dp(const vector<float> &e_levels,
+									stream<contour_point> &input_segments,
+									stream<topo> &topology,
+									elev_t granularity, float e_granularity,
+									vector<stream<contour_point>*> &outputs,
+									unsigned int threads,
+									algorithm alg) {
+	assert(e_levels.size() == outputs.size());
+#ifdef DEBUG_SIMPLIFICATION
+	if(start_debug()) {
+		cerr << "Topology: " << endl;
+		topo *t, prev(-10,-10,-10);
+		while(topology.read_item(&t) == NO_ERROR) {
+			cerr << " " << *t;
+			assert(prev.p <= t->p);
+			assert(prev.c < t->c);
+			if(is_level_line(t->c_z, granularity, e_granularity))
+				cerr << "(simplifiable)";
+			cerr << endl;
+			prev = *t;
+		}
+		topology.seek(0);
+	}
+#endif
+	cdp_stream_input input(topology, input_segments);
+	cdp_stream_output output(outputs);
+	cdp_run(e_levels, input, granularity, e_granularity, output, threads, alg);
+}
+
+void simplification::constrained_dp(const float e_simplify,
+									contour_record_stream &input,
+									elev_t granularity, float e_granularity,
+									contour_record_stream &output,
+									unsigned int threads,
+									algorithm alg) {
+	vector<contour_record_stream*> outputs(1, &output);
+	constrained_dp(vector<float>(1, e_simplify), input, granularity, e_granularity, outputs, threads, alg);
+}
+
+void simplification::constrained_dp(const vector<float> &e_levels,
+									contour_record_stream &input,
+									elev_t granularity, float e_granularity,
+									vector<contour_record_stream*> &outputs,
+									unsigned int threads,
+									algorithm alg) {
+	assert(e_levels.size() == outputs.size());
+	cdp_record_input in(input);
+	cdp_record_output out(outputs);
+	cdp_run(e_levels, in, granularity, e_granularity, out, threads, alg);
 }
@@ -4,6 +4,7 @@
 #ifndef __TEST_CONTOUR_SIMPLIFICATION_CONTOUR_SIMPLIFICATION_H__
 #define __TEST_CONTOUR_SIMPLIFICATION_CONTOUR_SIMPLIFICATION_H__
 #include "io_contours/contour_types.h"
+#include "io_contours/contour_records.h"
 #include "decomposition.h"
 #include <tpie/stream.h>
 #include <set>
@@ -23,18 +24,77 @@ typedef topology_edge topo;
 /////////////////////////////////////////////////////////
 namespace simplification {
 
+	/////////////////////////////////////////////////////////
+	///
+	///  Simplification of a single contour within the constraints:
+	///  DOUGLAS_PEUCKER splits the contour at the point farthest from the shortcut.
+	///  VISVALINGAM_WHYATT removes points in order of effective area (the area of the triangle
+	///  with the neighbours of the point), which gives smoother contours for large e.
+	///  Both keep all points within e of the simplified contour. VISVALINGAM_WHYATT takes O(nlogn)
+	///  when the removed points stay well within e and O(n^2) in the worst case (see vw).
+	///
+	/////////////////////////////////////////////////////////
+	enum algorithm { DOUGLAS_PEUCKER, VISVALINGAM_WHYATT };
+
 	/////////////////////////////////////////////////////////
 	///
 	///  Constrained Douglas Peucker's algorithm for polygonal line simplification.
-	///  The algorithm follows the simple original proposal with a running time between O(n) and O(n^2) (typically O(nlogn)).
+	///  The algorithm follows the simple original proposal. It takes O(nlogn) when the farthest points 
+	///  split the contours about evenly and O(n^2) in the worst case, such as for points along an arc 
+	///  around the shortcut. Long ranges skip blocks of points that cannot be the farthest (see 
+	///  dp_buffers), which helps when splits are uneven but does not improve the worst case.
 	///  e_simplify is the allowed error margin
 	///  This algorithm assumes the line segments of the contours are sorted and every contour forms a cycle.
+	///  Families of siblings are simplified by threads worker threads (0: one per core, 1: no workers, 
+	///  see io_contours/worker_threads.h).
+	///  The output does not depend on the number of threads. The families held in memory at once are 
+	///  limited by the memory available to TPIE, counting the points of a family once per level.
+	///  alg selects the simplification of a single contour.
 	///
 	/////////////////////////////////////////////////////////
 	void constrained_dp(const float e_simplify,
 						stream<contour_point> &input_segments,
 						stream<topo> &topology,
 						elev_t granularity, float e_granularity,
-						stream<contour_point> &output);
+						stream<contour_point> &output,
+						unsigned int threads = 0,
+						algorithm alg = DOUGLAS_PEUCKER);
+
+	/////////////////////////////////////////////////////////
+	///
+	///  Constrained simplification at several tolerances in one pass: Level i is simplified 
+	///  with e_levels[i] and written to outputs[i], exactly as constrained_dp would for that tolerance.
+	///  The streams are read and every family loaded once, the points of a contour are loaded 
+	///  into the distance tree once for all levels, and each family keeps one decomposition 
+	///  per level. Each level is topologically consistent on its own.
+	///
+	/////////////////////////////////////////////////////////
+	void constrained_dp(const std::vector<float> &e_levels,
+						stream<contour_point> &input_segments,
+						stream<topo> &topology,
+						elev_t granularity, float e_granularity,
+						std::vector<stream<contour_point>*> &outputs,
+						unsigned int threads = 0,
+						algorithm alg = DOUGLAS_PEUCKER);
+
+	/////////////////////////////////////////////////////////
+	///
+	///  As above, on contour records in the order of the topology. Whole contours are read and 
+	///  written at a time, and the output has the topology of the input.
+	///
+	/////////////////////////////////////////////////////////
+	void constrained_dp(const float e_simplify,
+						contour_record_stream &input,
+						elev_t granularity, float e_granularity,
+						contour_record_stream &output,
+						unsigned int threads = 0,
+						algorithm alg = DOUGLAS_PEUCKER);
+
+	void constrained_dp(const std::vector<float> &e_levels,
+						contour_record_stream &input,
+						elev_t granularity, float e_granularity,
+						std::vector<contour_record_stream*> &outputs,
+						unsigned int threads = 0,
+						algorithm alg = DOUGLAS_PEUCKER);
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_CONTOUR_SIMPLIFICATION_H__*/
@@ -115,45 +115,34 @@ void outputStreams(SHPHandle &shpHandle, DBFHandle &dbfHandle,
 				  SHPHandle &shpHandle_o, DBFHandle &dbfHandle_o,
 				  SHPHandle &shpHandle_b, DBFHandle &dbfHandle_b,
 				  SHPHandle &shpHandle_s, DBFHandle &dbfHandle_s,
-				  stream<contour_point> &uns,
-				  stream<contour_point> &sim,
-				  stream<topology_edge> &topology,
+				  contour_record_stream &uns,
+				  contour_record_stream *sim,
 				  float contour_interval, float e_z) {
-	contour_point *pu, *ps;
-	topology_edge *topo;
-	bool u_ok = uns.read_item(&pu) == NO_ERROR;
-	bool s_ok = sim.read_item(&ps) == NO_ERROR;
-	topology.seek(0);
-	while(topology.read_item(&topo) == NO_ERROR) {
-		if(u_ok && pu->label == topo->c) {
-			vector<contour_point> pts;
-			do {
-				pts.push_back(*pu);			
-			}
-			while((u_ok = (uns.read_item(&pu) == NO_ERROR)) && pu->label == topo->c);
+	contour_header h;
+	const contour_header *next;
+	vector<contour_point> pts;
+	while(uns.read(h, pts) == NO_ERROR) {
+		if(!pts.empty()) {
 			outputPoints(shpHandle, dbfHandle, shpHandle_o, dbfHandle_o,
 						 shpHandle_b, dbfHandle_b, shpHandle_s, dbfHandle_s,
-						 pts, topo->c_z,
+						 pts, h.z,
 						 contour_interval, e_z, false);
 		}
-		if(s_ok && ps->label == topo->c) {
-			vector<contour_point> pts;
-			do {
-				pts.push_back(*ps);			
+		if(sim != NULL && sim->peek(&next) == NO_ERROR && next->label == h.label) {
+			sim->read(h, pts);
+			if(!pts.empty()) {
+				outputPoints(shpHandle, dbfHandle, shpHandle_o, dbfHandle_o,
+							 shpHandle_b, dbfHandle_b, shpHandle_s, dbfHandle_s,
+							 pts, h.z,
+							 contour_interval, e_z, true);
 			}
-			while((s_ok = (sim.read_item(&ps) == NO_ERROR)) && ps->label == topo->c);
-			outputPoints(shpHandle, dbfHandle, shpHandle_o, dbfHandle_o,
-						 shpHandle_b, dbfHandle_b, shpHandle_s, dbfHandle_s,
-						 pts, topo->c_z,
-						 contour_interval, e_z, true);
 		}
 	}
 }
 
 void shape::to_shape(char const* const file_suffix,
-					 stream<contour_point>& unsimplified_stream,
-					 stream<topology_edge> &topology,				   
-					 stream<contour_point>* const simplified_stream,
+					 contour_record_stream &unsimplified,
+					 contour_record_stream* const simplified,
 					 float contour_interval, float e_z) {
 	SHPHandle shpHandle = SHPCreate(file_suffix, SHPT_POLYGON);
 	string s = ((string)file_suffix) + "_o";
@@ -191,13 +180,12 @@ void shape::to_shape(char const* const file_suffix,
 				  shpHandle_o, dbfHandle_o,
 				  shpHandle_b, dbfHandle_b,
 				  shpHandle_s, dbfHandle_s,
-				  unsimplified_stream, *simplified_stream, topology, contour_interval, e_z);
+				  unsimplified, simplified, contour_interval, e_z);
 	
-	if (simplified_stream != NULL) {
-		simplified_stream->seek(0);
+	if (simplified != NULL) {
+		simplified->rewind();
 	}
-	unsimplified_stream.seek(0);
-	topology.seek(0);
+	unsimplified.rewind();
 	
 	DBFClose(dbfHandle);
 	DBFClose(dbfHandle_o);
@@ -4,6 +4,7 @@
 #ifndef __TEST_CONTOUR_SIMPLIFICATION_CONTOUR_TO_SHAPE_H__
 #define __TEST_CONTOUR_SIMPLIFICATION_CONTOUR_TO_SHAPE_H__
 #include "io_contours/contour_types.h"
+#include "io_contours/contour_records.h"
 #include <tpie/stream.h>
 #include <set>
 
@@ -21,19 +22,17 @@ namespace shape {
   ///  Writes the contours to shape files.
   ///  path_name is the name of the file to be written.
   ///  (If the file already exists, it is overwritten)
-  ///  topo_stream contains the topology of the unsimplified stream
-  ///  (The simplified stream is assumed to be a subset)
-  ///	 unsimplified_stream is the unsimplified stream of contour segments.
+  ///	 unsimplified is the unsimplified contours with their topology.
   ///     These segments will be drawn black if info is null.
-  ///	 simplified_stream is the simplified stream of contour segments.
+  ///	 simplified is the simplified contours.
+  ///     (The simplified contours are assumed to be a subset in the same order)
   ///     These segments will be drawn blue if info is null or not at all if
-  ///     simplified_stream is null.
+  ///     simplified is null.
   ///
   /////////////////////////////////////////////////////////
   void to_shape(char const* const file_suffix,
-				stream<contour_point>& unsimplified_stream,
-				stream<topology_edge> &topology,				   
-				stream<contour_point>* const simplified_stream,
+				contour_record_stream &unsimplified,
+				contour_record_stream* const simplified,
 				float contour_interval, float e_z);
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_CONTOUR_TO_SHAPE_H__*/
@@ -8,7 +8,11 @@
 #include <set>
 #include <tpie/array.h>
 #include "util.h"
+#include <math.h>
 #include <iomanip>
+#include <limits>
+#include <algorithm>
+#include <new>
 
 //#define DEBUG_DECOMPOSITION_CONSTRUCT
 //#define DEBUG_DECOMPOSITION_WALK
@@ -54,10 +58,51 @@ bool is_level_line(elev_t candidate, elev_t granularity, float epsilon) {
 	return res;
 }
 
-link_point::link_point(const link_point &lp) : p(lp.p), prev(lp.prev), next(lp.next), up(lp.up), down(lp.down) {
+link_point::link_point(const link_point &lp) : p(lp.p), prev(lp.prev), next(lp.next), up(lp.up), down(lp.down), stamp(0), seen(0) {
 }
 
-link_point::link_point(contour_point &cp) : p(cp), prev(NULL), next(NULL), up(NULL), down(NULL) {
+link_point::link_point(contour_point &cp) : p(cp), prev(NULL), next(NULL), up(NULL), down(NULL), stamp(0), seen(0) {
+}
+
+static const size_t LINK_POINT_BLOCK = 1<<12; // link_points per block of a link_point_arena.
+
+link_point_arena::link_point_arena() : block(0), used(0), free_points(NULL) {
+}
+
+link_point_arena::~link_point_arena() {
+	for(vector<link_point*>::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+		operator delete(*it);
+	}
+}
+
+link_point* link_point_arena::create(contour_point &p) {
+	link_point *lp = free_points;
+	if(lp != NULL) {
+		free_points = lp->next;
+	}
+	else {
+		if(used == LINK_POINT_BLOCK) {
+			++block;
+			used = 0;
+		}
+		if(block == blocks.size()) {
+			blocks.push_back(static_cast<link_point*>(operator new(LINK_POINT_BLOCK*sizeof(link_point))));
+		}
+		lp = blocks[block] + used++;
+	}
+	return new(lp) link_point(p);
+}
+
+void link_point_arena::destroy(link_point *lp) {
+	lp->stamp = 0;
+	lp->next = free_points;
+	free_points = lp;
+}
+
+void link_point_arena::clear() {
+	block = 0;
+	used = 0;
+	free_points = NULL;
 }
 
 inline xycoord_t get_y(contour_point &p1, contour_point &p2, xycoord_t x) {
@@ -152,18 +197,6 @@ lp_seg::lp_seg() {
 	lp = NULL; // special constructor.
 }
 
-link_point* lp_seg::lp1() const {
-	return lp;
-}
-link_point* lp_seg::lp2() const {
-	return lp->prev;
-}
-contour_point lp_seg::p1() const {
-	return lp1()->p;
-}
-contour_point lp_seg::p2() const {
-	return lp2()->p;
-}
 link_point* lp_seg::lp_at(link_point *a) const {
 	return p1() == a->p ? lp1() : lp2();
 }
@@ -254,7 +287,7 @@ bool link_point::inside_up() {
 	return prev->p.x < p.x;
 }
 
-link_point* lp_seg::split(xycoord_t x) {
+link_point* lp_seg::split(xycoord_t x, link_point_arena &arena) {
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 	if(start_debug(p1())) {
 		cerr << "  Splitting " << *this << " at " << x;
@@ -263,7 +296,7 @@ link_point* lp_seg::split(xycoord_t x) {
 	assert(x < max(p1().x,p2().x));
 	assert(x > min(p1().x,p2().x));
 	contour_point c(x, eval(x), -1, lp->p.label);
-	link_point *np = new link_point(c);
+	link_point *np = arena.create(c);
 	link_point::connect(lp->prev, np);
 	link_point::connect(np, lp);
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
@@ -274,7 +307,7 @@ link_point* lp_seg::split(xycoord_t x) {
 	return np;
 }
 
-lp_seg lp_seg::split_from_below(link_point *llp, int parent) {
+lp_seg lp_seg::split_from_below(link_point *llp, int parent, link_point_arena &arena) {
 	if((llp->next->p.x == llp->p.x && llp->next->p.y > llp->p.y) ||
 	   (llp->prev->p.x == llp->p.x && llp->prev->p.y > llp->p.y)) {
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
@@ -302,7 +335,7 @@ lp_seg lp_seg::split_from_below(link_point *llp, int parent) {
 		own_lp = lp2();
 	}
 	else {
-		own_lp = split(llp->p.x);
+		own_lp = split(llp->p.x, arena);
 		no_split = false;
 	}
 	while(no_split && own_lp->down != NULL && own_lp->down->p.y >= llp->p.y) {
@@ -323,31 +356,7 @@ lp_seg lp_seg::split_from_below(link_point *llp, int parent) {
 	return *this;
 }
 
-lp_seg::lp_seg(contour_point &a) { // TODO: Make factory contructor!
-	lp = new link_point(a);
-	lp->prev = (lp->next = lp);
-}
-lp_seg::lp_seg(contour_point &a,contour_point &b) { // TODO: Make factory contructor!
-	lp = new link_point(a);
-	link_point *lpp = new link_point(b);
-	lp->prev = lpp;
-	lp->next = lp;
-}
-lp_seg::~lp_seg() {
-	if(lp != NULL && lp->next == lp) {
-#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
-		if(start_debug(p1())) {
-			cerr << "  Deleting special point lp_seg" << *lp << endl;
-		}
-#endif
-		if(lp->prev != lp)
-			delete lp->prev;
-		delete lp;
-	}
-	lp = NULL;
-}
-
-lp_seg lp_seg::split_from_above(link_point *llp, int parent) {
+lp_seg lp_seg::split_from_above(link_point *llp, int parent, link_point_arena &arena) {
 	if((llp->next->p.x == llp->p.x && llp->next->p.y < llp->p.y) ||
 	   (llp->prev->p.x == llp->p.x && llp->prev->p.y < llp->p.y)) {
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
@@ -370,7 +379,7 @@ lp_seg lp_seg::split_from_above(link_point *llp, int parent) {
 		own_lp = lp2();
 	}
 	else {
-		own_lp = split(llp->p.x);
+		own_lp = split(llp->p.x, arena);
 		no_split = false;
 	}
 	while(no_split && own_lp->up != NULL && own_lp->up->p.y <= llp->p.y) {
@@ -473,11 +482,7 @@ bool lp_seg::is_vertical() const {
 	return p1().x == p2().x;
 }
 
-bool ptr_cmp(link_point* a, link_point* b) {
-	return *a < *b;
-}
-
-typedef set<lp_seg,sl_cmp> lpsegpset;
+typedef lp_seg_line lpsegpset;
 
 lpsegpset::iterator scan_for(lp_seg &seg, lpsegpset sweep_line) {
 	lpsegpset::iterator it; 
@@ -555,7 +560,7 @@ inline bool lr_insert(link_point *&ll, link_point *&lu, link_point *&rl, link_po
 	}
 }
 
-link_point* decomposition::addContourToPQ(set<link_point*,bool(*)(link_point*,link_point*)> &pq, contour &c, bool do_contractions) {
+link_point* decomposition::linkContour(contour &c, bool do_contractions, link_point_arena &arena) {
 	bool first = true;
 	link_point *first_point = NULL, *prev = NULL;
 	for(contour::iterator it2 = c.begin(); it2 != c.end(); ++it2) {
@@ -570,7 +575,7 @@ link_point* decomposition::addContourToPQ(set<link_point*,bool(*)(link_point*,li
 		assert(prev == NULL || prev->p != p);
 		link_point *lp;
 		if(first) {
-			lp = new link_point(p);
+			lp = arena.create(p);
 			first_point = lp;
 			first = false;
 		}
@@ -579,7 +584,7 @@ link_point* decomposition::addContourToPQ(set<link_point*,bool(*)(link_point*,li
 //				break; // ensures we stop when first self-loop to 0 occurs. 
 		}
 		else {
-			lp = new link_point(p);
+			lp = arena.create(p);
 			link_point::connect(prev, lp);
 		}
 		prev = lp;
@@ -633,14 +638,18 @@ link_point* decomposition::addContourToPQ(set<link_point*,bool(*)(link_point*,li
 		}
 #endif			
 	}	
+	return first_point;
+}
+
+link_point* decomposition::addContourToPQ(vector<link_point*> &pq, contour &c, bool do_contractions, link_point_arena &arena) {
+	link_point *first_point = linkContour(c, do_contractions, arena);
 	
 	// Insert to PQ
-	prev = first_point;
+	link_point *prev = first_point;
 	do {
 		assert(prev->prev != NULL);
 		assert(prev->next != NULL);
-	    bool inserted = pq.insert(prev).second;
-		assert(inserted);
+		pq.push_back(prev);
 		prev = prev->next;
 	}
 	while(prev != first_point);
@@ -648,7 +657,7 @@ link_point* decomposition::addContourToPQ(set<link_point*,bool(*)(link_point*,li
 	return first_point;
 }
 
-decomposition::decomposition(int parent, int skip, map<int,contour* > &contours) {
+decomposition::decomposition(int parent, int skip, map<int,contour* > &contours, link_point_arena &a) : arena(a) {
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 	if(start_debug())
 		cerr << "Constructing decomposition for parent " << parent << " without " << skip << endl;
@@ -658,8 +667,9 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 	linear_scans = -1;
 	bfs_scans = 0;
 	bfs_steps = 0;
+	bfs_epoch = 0;
 	// add all points:
-	set<link_point*,bool(*)(link_point*,link_point*)> pq(ptr_cmp);
+	vector<link_point*> events, crossing;
 
 	for(map<int,vector<contour_point>* >::iterator it = contours.begin(); it != contours.end(); ++it) {
 		if(it->first == skip || it->second->size() < 4) {
@@ -673,26 +683,80 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 		if(start_debug())
 			cerr << "Adding contour " << it->first << " of size " << it->second->size() << endl;
 #endif
-		// Add all points to pq and 'points':
+		// Add all points to pq and 'rings':
 		contour *cont = it->second;
-		link_point *first_point = addContourToPQ(pq, *cont, true);
+		link_point *first_point = addContourToPQ(events, *cont, true, arena);
 		assert(first_point != NULL);
-		points.push_back(first_point);
+		rings[it->first] = first_point;
 	}
+	sort(events.begin(), events.end(), lp_ptr_cmp());
 	// Do sweep for splitting and up/down setting.
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 	if(start_debug()) {
-		cerr << "Starting sweep on |PG| = " << pq.size()<< endl;
-		print_set(pq);
+		cerr << "Starting sweep on |PG| = " << events.size()<< endl;
+		print_vector(events);
 		cerr << "---------------------------" << endl;
 	}
 #endif
-	
-	xycoord_t x;
+	sweep(events, crossing);
+
+	// Index the segments for find. About 4 points per cell, and at most a cell per 4 points 
+	// along each side, so the grid has O(|events|) cells:
+	grid_stamp = 0;
+	grid_x = events.empty() ? 0 : events.front()->p.x;
+	grid_y = events.empty() ? 0 : events.front()->p.y;
+	xycoord_t max_y = grid_y;
+	for(vector<link_point*>::iterator it = events.begin(); it != events.end(); ++it) {
+		grid_y = min(grid_y, (*it)->p.y);
+		max_y = max(max_y, (*it)->p.y);
+	}
+	double w = events.empty() ? 0 : events.back()->p.x - grid_x, h = max_y - grid_y;
+	double n = events.size() + 1;
+	grid_w = max(sqrt(w * h * 4 / n), max(w, h) * 4 / n);
+	if(grid_w <= 0)
+		grid_w = 1;
+	grid_cols = (int)(w / grid_w) + 1;
+	grid_rows = (int)(h / grid_w) + 1;
+	grid.resize(grid_cols * grid_rows);
+	for(map<int,link_point*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+		link_point *first = it->second, *lp = first;
+		do {
+			index_segment(lp);
+			lp = lp->next;
+		}
+		while(lp != first);
+	}
+
+#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
+	if(start_debug()) {
+		cerr << "Decomposition construction done " << endl;
+		print();
+	}
+#endif
+#ifdef DEBUG_DECOMPOSITION_WALK
+	if(start_debug())
+		print();
+#endif
+//	print();
+}
+
+/*
+  Sweeps the events (sorted as the PQ) for splitting and up/down setting. 
+  'crossing' are the segments (lp_seg) crossing the sweep line before the first event.
+ */
+void decomposition::sweep(vector<link_point*> &events, vector<link_point*> &crossing) {
+	if(events.empty())
+		return;
+	int parent = parent_contour;
+	xycoord_t x = events.front()->p.x;
 	sl_cmp sweep_line_cmp(parent, &x);
 	lpsegpset sweep_line(sweep_line_cmp);
+	for(vector<link_point*>::iterator it = crossing.begin(); it != crossing.end(); ++it) {
+		pair<lpsegpset::iterator,bool> pair = sweep_line.insert(lp_seg(*it));
+		assert(pair.second);
+	}
 
-	for(set<link_point*,bool(*)(link_point*,link_point*)>::iterator it_pq = pq.begin(); it_pq != pq.end();) {
+	for(vector<link_point*>::iterator it_pq = events.begin(); it_pq != events.end();) {
 		link_point *p = *it_pq;
 		x = p->p.x;
 
@@ -713,7 +777,7 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 			update_sweep_line(sweep_line, seg, is_left);
 
 			++it_pq;
-			if(it_pq == pq.end() || !(*p == **it_pq)) {
+			if(it_pq == events.end() || !(*p == **it_pq)) {
 				break;
 			}
 			assert(*p == **it_pq);
@@ -885,6 +949,11 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 
 		link_point *p_up = vu == NULL ? (ru == NULL ? lu : ru) : vu;
 		link_point *p_down = vl == NULL ? (ll == NULL ? rl : ll) : vl;
+		// down is found again by its segment, as shooting up invalidates iterators:
+		bool has_down = down != sweep_line.end();
+		lp_seg seg_down;
+		if(has_down)
+			seg_down = *down;
 		if(up != sweep_line.end() && p_up->inside_up(parent)) {
 			lp_seg seg_up = *up;
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
@@ -892,31 +961,30 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 				cerr << " Shooting up. Removing " << *up << endl;
 			}
 #endif
+			assert(!has_down || !(seg_down == seg_up));
 			sweep_line.erase(up);
-			lp_seg new_up = seg_up.split_from_below(p_up, parent);
+			lp_seg new_up = seg_up.split_from_below(p_up, parent, arena);
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 			if(start_debug(seg.p1())) {
 				cerr << " Inserting " << new_up << endl;
 			}
 #endif
 			pair<lpsegpset::iterator,bool> pair = sweep_line.insert(new_up);
-			assert(pair.second);				
+			assert(pair.second);
+			if(has_down)
+				down = sweep_line.find_exact(seg_down);
+			assert(!has_down || down != sweep_line.end());
 		}
-		if(down != sweep_line.end() && p_down->inside_down(parent)) {
+		if(has_down && p_down->inside_down(parent)) {
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 			if(start_debug(seg.p1())) {
 				cerr << " Shooting down " << endl;
-			}
-#endif
-			lp_seg seg_down = *down;
-#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
-			if(start_debug(seg.p1())) {
 				cerr << " Removing " << seg_down << endl;
 			}
 #endif
 			sweep_line.erase(down);
 
-			seg_down = seg_down.split_from_above(p_down, parent);
+			seg_down = seg_down.split_from_above(p_down, parent, arena);
 #ifdef DEBUG_DECOMPOSITION_CONSTRUCT
 			if(start_debug(seg.p1())) {
 				cerr << " Inserting " << seg_down << endl;
@@ -926,33 +994,241 @@ decomposition::decomposition(int parent, int skip, map<int,contour* > &contours)
 			assert(pair.second);
 		}
 	}
+}
 
-#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
-	if(start_debug()) {
-		cerr << "Decomposition construction done " << endl;
-		print();
+decomposition::~decomposition() {
+	rings.clear();
+	arena.clear();
+}
+
+int decomposition::grid_col(xycoord_t x) {
+	if(x <= grid_x)
+		return 0;
+	xycoord_t i = (x - grid_x) / grid_w;
+	if(i >= grid_cols - 1)
+		return grid_cols - 1;
+	return (int)i;
+}
+
+int decomposition::grid_row(xycoord_t y) {
+	if(y <= grid_y)
+		return 0;
+	xycoord_t i = (y - grid_y) / grid_w;
+	if(i >= grid_rows - 1)
+		return grid_rows - 1;
+	return (int)i;
+}
+
+/*
+  Adds the segment from lp to lp->prev to the cells it passes if a trapezoid can be above it.
+  Earlier entries of the segment become invalid, so segments changed by splits or by removed 
+  split points are simply indexed again.
+ */
+void decomposition::index_segment(link_point *lp) {
+	lp_seg seg(lp);
+	if(seg.is_vertical() || !seg.inside_up(parent_contour))
+		return;
+	if(++grid_stamp == 0)
+		++grid_stamp;
+	lp->stamp = grid_stamp;
+	contour_point left = lp->p, right = lp->prev->p;
+	if(right.x < left.x)
+		swap(left, right);
+	int from = grid_col(left.x);
+	int to = grid_col(right.x);
+	for(int c = from; c <= to; ++c) {
+		// The rows passed by the piece of the segment in column c:
+		xycoord_t y1 = c == from ? left.y : seg.eval(grid_x + c*grid_w);
+		xycoord_t y2 = c == to ? right.y : seg.eval(grid_x + (c+1)*grid_w);
+		int r1 = grid_row(min(y1, y2));
+		int r2 = grid_row(max(y1, y2));
+		for(int r = r1; r <= r2; ++r)
+			grid[c*grid_rows + r].push_back(make_pair(lp, grid_stamp));
 	}
-#endif
-#ifdef DEBUG_DECOMPOSITION_WALK
-	if(start_debug())
-		print();
-#endif
-//	print();
 }
 
-decomposition::~decomposition() {
-	for(vector<link_point*>::iterator it = points.begin(); it != points.end(); ++it) {
-		link_point *first = *it;
+/*
+  Returns whichever of a and b comes first when scanning the rings in order.
+ */
+link_point* decomposition::first_in_scan(link_point *a, link_point *b) {
+	if(a->p.label != b->p.label)
+		return a->p.label < b->p.label ? a : b;
+	link_point *first = rings[a->p.label], *lp = first;
+	do {
+		if(lp == a || lp == b)
+			return lp;
+		lp = lp->next;
+	}
+	while(lp != first);
+	assert(false);
+	return a;
+}
+
+// Split points right of a slab being swept again. See decomposition::replace.
+struct split_replay {
+	link_point *right; // Original right end point of the segment.
+	bool right_is_next; // Ring order goes from left to right.
+	vector<link_point*> splits; // Increasing x.
+
+	split_replay(link_point *r, bool n) : right(r), right_is_next(n) {}
+};
+
+void decomposition::replace(const vector<int> &out, map<int,contour*> &in) {
+	// The guide and the statistics are per contour being simplified:
+	guide = NULL;
+	linear_scans = -1;
+	bfs_scans = 0;
+	bfs_steps = 0;
+
+	// Remove and add contours while finding the slab [a;b] to sweep again:
+	xycoord_t a = numeric_limits<xycoord_t>::max();
+	xycoord_t b = -a;
+	for(vector<int>::const_iterator it = out.begin(); it != out.end(); ++it) {
+		map<int,link_point*>::iterator it2 = rings.find(*it);
+		if(it2 == rings.end())
+			continue; // Too small to be in the decomposition.
+		link_point *first = it2->second;
 		link_point *next = first->next;
+		a = min(a, first->p.x);
+		b = max(b, first->p.x);
 		do {
 			link_point *nn = next->next;
-			delete next;
+			a = min(a, next->p.x);
+			b = max(b, next->p.x);
+			arena.destroy(next);
 			next = nn;
 		}
 		while(next != first);
-		delete first;
+		arena.destroy(first);
+		rings.erase(it2);
 	}
-	points.clear();
+	for(map<int,contour*>::iterator it = in.begin(); it != in.end(); ++it) {
+		contour *cont = it->second;
+		if(cont->size() < 4)
+			continue;
+		for(contour::iterator it2 = cont->begin(); it2 != cont->end(); ++it2) {
+			a = min(a, it2->x);
+			b = max(b, it2->x);
+		}
+		rings[it->first] = linkContour(*cont, true, arena);
+	}
+	if(a > b)
+		return;
+#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
+	if(start_debug())
+		cerr << "Replacing contours in slab " << a << " to " << b << endl;
+#endif
+
+	// Strip split points and up/down links in [a;b]. Split points right of b on segments 
+	// crossing b are detached, as their y depend on the splits made in [a;b]:
+	vector<link_point*> events, crossing;
+	vector<split_replay> replays;
+	vector<pair<link_point*,link_point*> > touched; // Segments (v,w) overlapping [a;b].
+	for(map<int,link_point*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+		link_point *first = it->second, *v = first;
+		do {
+			assert(v->p.rank != -1);
+			link_point *w = v->next;
+			vector<link_point*> splits;
+			while(w->p.rank == -1) {
+				splits.push_back(w);
+				w = w->next;
+			}
+			if(v->p.x >= a && v->p.x <= b) {
+				v->up = v->down = NULL;
+				events.push_back(v);
+			}
+			if(v->p.x == w->p.x) { // vertical.
+				assert(splits.empty());
+				v = w;
+				continue;
+			}
+
+			bool left_to_right = v->p.x < w->p.x;
+			link_point *l = left_to_right ? v : w;
+			link_point *r = left_to_right ? w : v;
+			if(!left_to_right)
+				reverse(splits.begin(), splits.end());
+			vector<link_point*> kept;
+			split_replay replay(r, left_to_right);
+			for(vector<link_point*>::iterator it2 = splits.begin(); it2 != splits.end(); ++it2) {
+				link_point *s = *it2;
+				if(s->p.x < a || l->p.x > b)
+					kept.push_back(s);
+				else if(s->p.x <= b)
+					arena.destroy(s);
+				else
+					replay.splits.push_back(s);
+			}
+			if(!left_to_right)
+				reverse(kept.begin(), kept.end());
+			link_point *prev = v;
+			for(vector<link_point*>::iterator it2 = kept.begin(); it2 != kept.end(); ++it2) {
+				prev->next = *it2;
+				(*it2)->prev = prev;
+				prev = *it2;
+			}
+			prev->next = w;
+			w->prev = prev;
+
+			if(l->p.x <= b && r->p.x >= a)
+				touched.push_back(make_pair(v, w));
+			if(l->p.x < a && r->p.x >= a)
+				crossing.push_back(left_to_right ? w : v->next);
+			if(!replay.splits.empty())
+				replays.push_back(replay);
+			v = w;
+		}
+		while(v != first);
+	}
+
+	// Vertical segments as when linking the contours:
+	for(map<int,link_point*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+		link_point *first = it->second, *lp = first;
+		do {
+			link_point *next = lp->next;
+			if(lp->p.x == next->p.x && lp->p.y != next->p.y && lp->p.x >= a && lp->p.x <= b) {
+				if(lp->p.y < next->p.y)
+					link_point::connect_vertical(next, lp);
+				else
+					link_point::connect_vertical(lp, next);
+			}
+			lp = next;
+		}
+		while(lp != first);
+	}
+
+	sort(events.begin(), events.end(), lp_ptr_cmp());
+	sweep(events, crossing);
+
+	// Link detached split points in again as if split by the sweep:
+	for(vector<split_replay>::iterator it = replays.begin(); it != replays.end(); ++it) {
+		for(vector<link_point*>::iterator it2 = it->splits.begin(); it2 != it->splits.end(); ++it2) {
+			link_point *s = *it2;
+			link_point *lp = it->right_is_next ? it->right : it->right->next;
+			s->p.y = lp_seg(lp).eval(s->p.x);
+			s->prev = lp->prev;
+			s->next = lp;
+			lp->prev->next = s;
+			lp->prev = s;
+		}
+	}
+
+	// Index the pieces of the segments in the slab again:
+	for(vector<pair<link_point*,link_point*> >::iterator it = touched.begin(); it != touched.end(); ++it) {
+		link_point *lp = it->first;
+		do {
+			lp = lp->next;
+			index_segment(lp);
+		}
+		while(lp != it->second);
+	}
+#ifdef DEBUG_DECOMPOSITION_CONSTRUCT
+	if(start_debug()) {
+		cerr << "Replacement done " << endl;
+		print();
+	}
+#endif
 }
 
 lp_seg lp_seg::seg_above() {
@@ -1155,17 +1431,19 @@ bool lp_seg::contains_p_above(contour_point p, contour_point pm) {
 	contour_point right = p2();
 	if(left.x > right.x)
 		swap(left,right);
+	if(left.x > p.x || right.x < p.x || eval(p.x) > p.y ||
+	   (left.x == p.x && pm.x < p.x) || (right.x == p.x && pm.x > p.x)) {
+		return false;
+	}
+	// Only look above when p is over this segment:
 	lp_seg above = seg_above();
+	if(above.eval(p.x) < p.y)
+		return false;
 	contour_point above_left = above.p1();
 	contour_point above_right = above.p2();
 	if(above_left.x > above_right.x)
 		swap(above_left,above_right);
 
-	if(left.x > p.x || right.x < p.x || eval(p.x) > p.y || above.eval(p.x) < p.y ||
-	   (left.x == p.x && pm.x < p.x) || (right.x == p.x && pm.x > p.x)) {
-		return false;
-	}
-
 	if(left.x == p.x) {
 		if(pm.x == p.x) {
 			return eval(pm.x) <= pm.y || above.eval(pm.x) >= pm.y;
@@ -1174,13 +1452,13 @@ bool lp_seg::contains_p_above(contour_point p, contour_point pm) {
 			if(left.x < pm.x)
 				return eval(pm.x) <= pm.y;
 			else
-				return right.y <= lp_seg(p,pm).eval(right.x);
+				return right.y <= get_y(p,pm,right.x);
 		}
 		if(above_left == p) {
 			if(right.x < pm.x)
 				return above.eval(pm.x) >= pm.y;
 			else
-				return above_right.y >= lp_seg(p,pm).eval(above_right.x);
+				return above_right.y >= get_y(p,pm,above_right.x);
 		}
 	}
 	else if(right.x == p.x) {
@@ -1191,13 +1469,13 @@ bool lp_seg::contains_p_above(contour_point p, contour_point pm) {
 			if(left.x < pm.x)
 				return eval(pm.x) <= pm.y;
 			else
-				return left.y <= lp_seg(p,pm).eval(left.x);
+				return left.y <= get_y(p,pm,left.x);
 		}
 		if(above_right == p) {
 			if(left.x < pm.x)
 				return above.eval(pm.x) >= pm.y;
 			else
-				return above_left.y >= lp_seg(p,pm).eval(above_left.x);
+				return above_left.y >= get_y(p,pm,above_left.x);
 		}
 	}
 	return true;
@@ -1219,14 +1497,26 @@ link_point* decomposition::bfs_find(contour_point p,contour_point pm,link_point*
 #endif
 		return find(p,pm);
 	}
-	queue<link_point*> q;
-	q.push(guide);
-	set<link_point*> seen;
+	// A new epoch makes all points unseen. Reset the marks when it wraps around:
+	if(++bfs_epoch == 0) {
+		for(map<int,link_point*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+			link_point *first = it->second, *lp = first;
+			do {
+				lp->seen = 0;
+				lp = lp->next;
+			}
+			while(lp != first);
+		}
+		bfs_epoch = 1;
+	}
+	// Every point is queued at most once, so the queue is the front of bfs_queue:
+	bfs_queue.clear();
+	bfs_queue.push_back(guide);
+	size_t head = 0;
 
 	int iterations = 0;
-	while(!q.empty()) {
-		link_point *llp = q.front();
-		q.pop();
+	while(head < bfs_queue.size()) {
+		link_point *llp = bfs_queue[head++];
 		++iterations;
 		bfs_steps++;
 #ifdef DEBUG_DECOMPOSITION_WALK
@@ -1257,12 +1547,14 @@ link_point* decomposition::bfs_find(contour_point p,contour_point pm,link_point*
 			
 			while(lp != NULL) {
 				lp_seg seg2(lp);
-				if(lp != llp && !seg2.is_vertical() && seg2.inside_up(parent_contour) && seen.insert(lp).second) {
-					q.push(lp);
+				if(lp != llp && lp->seen != bfs_epoch && !seg2.is_vertical() && seg2.inside_up(parent_contour)) {
+					lp->seen = bfs_epoch;
+					bfs_queue.push_back(lp);
 				}
 				seg2 = lp_seg(lp->next);
-				if(lp->next != llp && !seg2.is_vertical() && seg2.inside_up(parent_contour) && seen.insert(lp->next).second) {
-					q.push(lp->next);
+				if(lp->next != llp && lp->next->seen != bfs_epoch && !seg2.is_vertical() && seg2.inside_up(parent_contour)) {
+					lp->next->seen = bfs_epoch;
+					bfs_queue.push_back(lp->next);
 				}
 				lp = lp->down;
 			}
@@ -1288,29 +1580,43 @@ link_point* decomposition::find(contour_point p,contour_point pm) {
 		cerr << " Starting linear scan for p " << p << endl;
 	}
 #endif
-	for(vector<link_point*>::iterator it = points.begin(); it != points.end(); ++it) {
-		link_point *first = *it, *lp = first;
-		do {
+	// The segment below p is in the column of p, in the row of p or below. The rows are 
+	// scanned downwards (from one above, for rounding) to the first row with a segment strictly 
+	// below p: Trapezoids above segments further down cannot reach p. So the cells scanned are 
+	// those of the trapezoid of p in the column, plus one. Invalid entries are dropped while 
+	// scanning, and when p is on the boundary of several trapezoids, the one found first 
+	// by a scan of the rings is used:
+	int c = grid_col(p.x);
+	link_point *found = NULL;
+	bool below = false;
+	for(int r = min(grid_row(p.y) + 1, grid_rows - 1); r >= 0 && !below; --r) {
+		vector<pair<link_point*,unsigned int> > &cell = grid[c*grid_rows + r];
+		size_t valid = 0;
+		for(size_t i = 0; i < cell.size(); ++i) {
+			link_point *lp = cell[i].first;
+			if(lp->stamp != cell[i].second)
+				continue;
+			cell[valid++] = cell[i];
 			lp_seg seg(lp);
-			if(!seg.is_vertical() && seg.inside_up(parent_contour) && seg.contains_p_above(p,pm)) {
+			if(seg.contains_p_above(p,pm)) {
 #ifdef DEBUG_DECOMPOSITION_WALK
 				if(start_debug(p)) {
 					cerr << "  Found: " << seg << endl;
 					cerr << "  Found (lp): " << *lp << endl;
 				}
 #endif
-				return lp;
+				found = found == NULL ? lp : first_in_scan(found, lp);
+				below |= seg.eval(p.x) < p.y;
 			}
-			lp = lp->next;
 		}
-		while(lp != first);
+		cell.resize(valid);
 	}
 #ifdef DEBUG_DECOMPOSITION_WALK
-	if(start_debug(p)) {
+	if(found == NULL && start_debug(p)) {
 		cerr << "Linear scan fail!" << endl;
 	}
 #endif
-	return NULL;
+	return found;
 }
 
 bool lp_seg::intersects(contour_point &lp1, contour_point &lp2) {
@@ -1393,10 +1699,10 @@ bool lp_seg::intersects_line(contour_point &lp1, contour_point &lp2) {
 		order_l = -simplification::int_sign(det341, SQRT_EPSILON);
 #ifdef DEBUG_DECOMPOSITION_WALK
 		if(order_l > 0) {
-			assert(y1 < lp_seg(ll,lr).eval(x1));
+			assert(y1 < get_y(ll,lr,x1));
 		}
 		else if(order_l < 0) {
-			assert(y1 > lp_seg(ll,lr).eval(x1));
+			assert(y1 > get_y(ll,lr,x1));
 		}
 #endif
 	}
@@ -1429,10 +1735,10 @@ bool lp_seg::intersects_line(contour_point &lp1, contour_point &lp2) {
 		order_r = -simplification::int_sign(det342, SQRT_EPSILON);
 #ifdef DEBUG_DECOMPOSITION_WALK
 		if(order_r > 0) {
-			assert(y2 < lp_seg(ll,lr).eval(x2));
+			assert(y2 < get_y(ll,lr,x2));
 		}
 		else if(order_r < 0) {
-			assert(y2 > lp_seg(ll,lr).eval(x2));
+			assert(y2 > get_y(ll,lr,x2));
 		}
 #endif
 	}
@@ -1462,6 +1768,16 @@ bool lp_seg::intersects_line(contour_point &lp1, contour_point &lp2) {
 	return order_l == 0 || order_r == 0 || order_l != order_r;
 }
 
+link_point* decomposition::locate(contour_point p, contour_point pm) {
+	if(guide == NULL) {
+		guide = find(p,pm);
+	}
+	else if(!lp_seg(guide).contains_p_above(p, pm)) {
+		guide = bfs_find(p,pm,guide);
+	}
+	return guide;
+}
+
 bool decomposition::contains_line(vector<contour_point> &points, int p1i, int p2i) {
 	if(points.empty())
 		return true;
@@ -1477,14 +1793,8 @@ bool decomposition::contains_line(vector<contour_point> &points, int p1i, int p2
 			cerr << lp_seg(guide) << endl;
 	}
 #endif
-	if(guide == NULL) {
-		guide = find(p1,pm);
-	}
-	else if(!lp_seg(guide).contains_p_above(p1, pm)) {
-		guide = bfs_find(p1,pm,guide);
-	}
-	link_point *lp = guide;
-	if(guide == NULL)
+	link_point *lp = locate(p1, pm);
+	if(lp == NULL)
 		return false;
 
 	// Build can. seq:
@@ -1667,9 +1977,9 @@ bool decomposition::walk_contour(contour_point &p1, contour_point &p2,
 
 void decomposition::print() {
 	cerr << "Decomposition:" << endl;
-	for(vector<link_point*>::iterator it = points.begin(); it != points.end(); ++it) {
-		cerr << " Contour with points: " << endl;
-		link_point *first = *it;
+	for(map<int,link_point*>::iterator it = rings.begin(); it != rings.end(); ++it) {
+		cerr << " Contour " << it->first << " with points: " << endl;
+		link_point *first = it->second;
 		link_point *lp = first;
 		do {
 			assert(lp != NULL);
@@ -7,7 +7,9 @@
 #include "io_contours/contour_types.h"
 #include <tpie/array.h>
 #include <set>
+#include <map>
 #include <vector>
+#include <algorithm>
 #include <iomanip>
 
 using namespace terrastream;
@@ -31,6 +33,8 @@ bool is_level_line(elev_t candidate, elev_t granularity, float epsilon);
 struct link_point {
 	contour_point p;
 	link_point *prev, *next, *up, *down;
+	unsigned int stamp; // Of the entries of the segment to prev in the index of a decomposition. 0: none.
+	unsigned int seen; // Epoch of the last BFS of a decomposition to reach this point.
 
 	link_point(const link_point &lp);
 	link_point(contour_point &p);
@@ -67,25 +71,55 @@ struct link_point {
 	}
 };
 
+// Orders the points of an event queue by x, y, label and rank.
+struct lp_ptr_cmp {
+	bool operator()(const link_point *a, const link_point *b) const {
+		if(a->p.x != b->p.x)
+			return a->p.x < b->p.x;
+		if(a->p.y != b->p.y)
+			return a->p.y < b->p.y;
+		if(a->p.label != b->p.label)
+			return a->p.label < b->p.label;
+		return a->p.rank < b->p.rank;
+	}
+};
+
+/*
+  Allocates link_points in blocks. Destroyed points are reused, and clear() releases all points 
+  at once while keeping the blocks, so an arena can be reused by one decomposition after another.
+ */
+class link_point_arena {
+public:
+	link_point_arena();
+	~link_point_arena();
+	link_point* create(contour_point &p);
+	void destroy(link_point *lp);
+	void clear();
+private:
+	vector<link_point*> blocks;
+	size_t block, used; // Block in use and points used in it.
+	link_point *free_points; // Linked by next.
+
+	link_point_arena(const link_point_arena &a);
+	link_point_arena& operator=(const link_point_arena &a);
+};
+
 struct lp_seg {
 	lp_seg(link_point *lp);
 	lp_seg(const lp_seg &s);
 	lp_seg();
-	lp_seg(contour_point &a);
-	lp_seg(contour_point &a, contour_point &b);
-	~lp_seg();
-	contour_point p1() const;
-	contour_point p2() const;
-	link_point* lp1() const;
-	link_point* lp2() const;
+	const contour_point& p1() const { return lp->p; }
+	const contour_point& p2() const { return lp->prev->p; }
+	link_point* lp1() const { return lp; }
+	link_point* lp2() const { return lp->prev; }
 	link_point* lp_at(link_point *guide) const;
 
 	bool intersects(contour_point &p1, contour_point &p2);
 	lp_seg seg_above();
 	lp_seg seg_below();
 	bool contains_p_above(contour_point p,contour_point p_guide);
-	lp_seg split_from_below(link_point *lp, int parent);
-	lp_seg split_from_above(link_point *lp, int parent);
+	lp_seg split_from_below(link_point *lp, int parent, link_point_arena &arena);
+	lp_seg split_from_above(link_point *lp, int parent, link_point_arena &arena);
 	bool inside_up(int parent_contour) const;
 	xycoord_t eval(xycoord_t x) const; // Deprecate anything but use for creation! (ie. privatice)
 	bool is_vertical() const;
@@ -138,7 +172,7 @@ struct lp_seg {
 private:
 	bool intersects_line(contour_point &lp1, contour_point &lp2);
 	bool inside_up() const; // of contour, ignoring label.
-	link_point *split(xycoord_t x);
+	link_point *split(xycoord_t x, link_point_arena &arena);
 	link_point *lp;
 };
 
@@ -250,12 +284,21 @@ struct sl_cmp {
 		return s341;
 	}
 
-	int compare_y(contour_point p1,contour_point p2, 
-				  contour_point p3,contour_point p4) {
-		if(p1.x > p2.x)
-			swap(p1,p2);
-		if(p3.x > p4.x)
-			swap(p3,p4);
+	int compare_y(contour_point const &a1,contour_point const &a2, 
+				  contour_point const &b1,contour_point const &b2) {
+		if(a1.x > a2.x) {
+			if(b1.x > b2.x)
+				return compare_y_ordered(a2,a1,b2,b1);
+			return compare_y_ordered(a2,a1,b1,b2);
+		}
+		if(b1.x > b2.x)
+			return compare_y_ordered(a1,a2,b2,b1);
+		return compare_y_ordered(a1,a2,b1,b2);
+	}
+
+	// As compare_y with p1.x <= p2.x and p3.x <= p4.x:
+	int compare_y_ordered(contour_point const &p1,contour_point const &p2, 
+						  contour_point const &p3,contour_point const &p4) {
 #ifdef DEBUG_SLC
 		if(start_debug(p1)) {
 			cerr << " Comparing " << p1 << "-" << p2 << " vs " << p3 << "-" << p4 << endl;
@@ -469,18 +512,247 @@ struct sl_cmp {
 	}
 };
 
+static const size_t LP_SEG_BLOCK = 128; // Most segments in a block of an lp_seg_line.
+
+/*
+  Sweep line of segments ordered by an sl_cmp. The segments (a pointer each) are kept in sorted 
+  blocks of at most LP_SEG_BLOCK segments, and a block is found by a binary search on the last 
+  segment of each block. An insert or erase moves segments within one block, so it takes 
+  O(log n + LP_SEG_BLOCK) time. A full block is split and a block under a quarter full is merged 
+  with a neighbour, which moves the n/LP_SEG_BLOCK block pointers at most once every 
+  LP_SEG_BLOCK/4 updates of the block. Insert and erase invalidate iterators.
+ */
+class lp_seg_line {
+	typedef vector<lp_seg> block;
+public:
+	class iterator {
+	public:
+		iterator() : blocks(NULL), b(0), i(0) {}
+		lp_seg& operator*() const { return (*(*blocks)[b])[i]; }
+		lp_seg* operator->() const { return &(*(*blocks)[b])[i]; }
+		iterator& operator++() {
+			if(++i == (*blocks)[b]->size()) {
+				++b;
+				i = 0;
+			}
+			return *this;
+		}
+		iterator& operator--() {
+			if(i == 0)
+				i = (*blocks)[--b]->size();
+			--i;
+			return *this;
+		}
+		bool operator==(const iterator &o) const { return b == o.b && i == o.i; }
+		bool operator!=(const iterator &o) const { return !(*this == o); }
+	private:
+		friend class lp_seg_line;
+		iterator(vector<block*> *bl, size_t _b, size_t _i) : blocks(bl), b(_b), i(_i) {}
+		vector<block*> *blocks;
+		size_t b, i; // Block and position in it. end() is (number of blocks, 0).
+	};
+
+	lp_seg_line(const sl_cmp &c) : cmp(c), n(0) {}
+	lp_seg_line(const lp_seg_line &l) : cmp(l.cmp), n(0) {
+		copy_blocks(l);
+	}
+	lp_seg_line& operator=(const lp_seg_line &l) {
+		if(this != &l) {
+			cmp = l.cmp;
+			clear();
+			copy_blocks(l);
+		}
+		return *this;
+	}
+	~lp_seg_line() {
+		clear();
+		for(size_t j = 0; j < spare.size(); ++j)
+			delete spare[j];
+	}
+
+	iterator begin() { return iterator(&blocks, 0, 0); }
+	iterator end() { return iterator(&blocks, blocks.size(), 0); }
+	bool empty() const { return n == 0; }
+	size_t size() const { return n; }
+
+	iterator lower_bound(const lp_seg &s) {
+		// First block with a last segment not before s:
+		size_t lo = 0, hi = blocks.size();
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if(cmp(blocks[mid]->back(), s))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(lo == blocks.size())
+			return end();
+		block &bl = *blocks[lo];
+		return iterator(&blocks, lo, std::lower_bound(bl.begin(), bl.end(), s, cmp_ref(&cmp)) - bl.begin());
+	}
+	iterator upper_bound(const lp_seg &s) {
+		// First block with a last segment after s:
+		size_t lo = 0, hi = blocks.size();
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if(cmp(s, blocks[mid]->back()))
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		if(lo == blocks.size())
+			return end();
+		block &bl = *blocks[lo];
+		return iterator(&blocks, lo, std::upper_bound(bl.begin(), bl.end(), s, cmp_ref(&cmp)) - bl.begin());
+	}
+	iterator find(const lp_seg &s) {
+		iterator it = lower_bound(s);
+		return it == end() || cmp(s, *it) ? end() : it;
+	}
+	// As find, but returns s itself rather than the first segment ordered as s.
+	iterator find_exact(const lp_seg &s) {
+		iterator it = lower_bound(s);
+		while(it != end() && !(*it == s) && !cmp(s, *it))
+			++it;
+		return it != end() && *it == s ? it : end();
+	}
+	pair<iterator,bool> insert(const lp_seg &s) {
+		iterator it = lower_bound(s);
+		if(it != end() && !cmp(s, *it))
+			return make_pair(it, false);
+		if(it == end()) { // Append to the last block:
+			if(blocks.empty())
+				blocks.push_back(new_block());
+			it = iterator(&blocks, blocks.size()-1, blocks.back()->size());
+		}
+		block &bl = *blocks[it.b];
+		bl.insert(bl.begin() + it.i, s);
+		++n;
+		if(bl.size() > LP_SEG_BLOCK) { // Split:
+			block *upper = new_block();
+			upper->assign(bl.begin() + bl.size()/2, bl.end());
+			bl.resize(bl.size()/2);
+			blocks.insert(blocks.begin() + it.b + 1, upper);
+			if(it.i >= bl.size()) {
+				it.i -= bl.size();
+				++it.b;
+			}
+		}
+		return make_pair(it, true);
+	}
+	size_t erase(const lp_seg &s) {
+		iterator it = find(s);
+		if(it == end())
+			return 0;
+		erase(it);
+		return 1;
+	}
+	void erase(iterator it) {
+		block &bl = *blocks[it.b];
+		bl.erase(bl.begin() + it.i);
+		--n;
+		if(bl.size() >= LP_SEG_BLOCK/4)
+			return;
+		// Merge with a neighbour if they fit in a block:
+		if(it.b + 1 < blocks.size() && bl.size() + blocks[it.b+1]->size() <= LP_SEG_BLOCK)
+			merge(it.b);
+		else if(it.b > 0 && blocks[it.b-1]->size() + bl.size() <= LP_SEG_BLOCK)
+			merge(it.b - 1);
+		else if(bl.empty())
+			remove_block(it.b);
+	}
+
+	friend void print_set(lp_seg_line &s) {
+		cerr << "|set<>| = " << s.size() << endl;
+		for(iterator it = s.begin(); it != s.end(); ++it)
+			cerr << " " << *it << endl;
+	}
+private:
+	// The standard algorithms copy comparators, while the state of cmp must be kept.
+	struct cmp_ref {
+		sl_cmp *c;
+		cmp_ref(sl_cmp *_c) : c(_c) {}
+		bool operator()(const lp_seg &a, const lp_seg &b) const { return (*c)(a, b); }
+	};
+
+	block* new_block() {
+		if(spare.empty())
+			return new block();
+		block *bl = spare.back();
+		spare.pop_back();
+		return bl;
+	}
+	void remove_block(size_t b) {
+		blocks[b]->clear();
+		spare.push_back(blocks[b]);
+		blocks.erase(blocks.begin() + b);
+	}
+	// Moves the segments of block b+1 to the end of block b.
+	void merge(size_t b) {
+		blocks[b]->insert(blocks[b]->end(), blocks[b+1]->begin(), blocks[b+1]->end());
+		remove_block(b+1);
+	}
+	void clear() {
+		while(!blocks.empty())
+			remove_block(blocks.size()-1);
+		n = 0;
+	}
+	void copy_blocks(const lp_seg_line &l) {
+		for(size_t b = 0; b < l.blocks.size(); ++b) {
+			blocks.push_back(new_block());
+			*blocks.back() = *l.blocks[b];
+		}
+		n = l.n;
+	}
+
+	sl_cmp cmp;
+	vector<block*> blocks; // None is empty.
+	vector<block*> spare; // Emptied blocks for reuse.
+	size_t n;
+};
+
 class decomposition {
 public:
-	decomposition(int parent, int skip, map<int,vector<contour_point>* > &contours);
+	// All points are allocated in arena, which is cleared when the decomposition is deleted.
+	decomposition(int parent, int skip, map<int,vector<contour_point>* > &contours, link_point_arena &arena);
 	~decomposition();
     bool contains_line(vector<contour_point> &v, int p1, int p2);
-	static link_point* addContourToPQ(set<link_point*,bool(*)(link_point*,link_point*)> &pq, contour &c, bool d);
+	// Returns the segment below the trapezoid where the line from p towards pm starts. The search
+	// starts from the end of the last line, and the result is the start of the next contains_line.
+	link_point* locate(contour_point p, contour_point pm);
+	// Makes lp (from locate) the start of the next contains_line.
+	void set_guide(link_point *lp) { guide = lp; }
+	// Removes the contours 'out' and adds the contours 'in' as if the decomposition was 
+	// constructed with them. Only the x-range spanned by the changed contours is swept again.
+	void replace(const vector<int> &out, map<int,vector<contour_point>* > &in);
+	// Appends the points of c to pq, which must be sorted by lp_ptr_cmp before it is swept.
+	static link_point* addContourToPQ(vector<link_point*> &pq, contour &c, bool d, link_point_arena &arena);
+	static link_point* linkContour(contour &c, bool d, link_point_arena &arena);
 	int linear_scans, bfs_scans, bfs_steps;
 private:
 	int parent_contour;
-	vector<link_point*> points;
+	link_point_arena &arena;
+	map<int,link_point*> rings; // contour label -> first point of ring.
 	link_point *guide;
 
+	// Uniform grid of square cells of the segments with a trapezoid above (see find). A segment 
+	// is in the cells passed by its piece in each column, so it is in O(1 + length/grid_w) cells.
+	// Entries are (segment, stamp) and only valid while the stamp is that of the segment:
+	xycoord_t grid_x, grid_y, grid_w; // Corner of the first cell and width of cells.
+	int grid_cols, grid_rows;
+	vector<vector<pair<link_point*,unsigned int> > > grid; // Column by column.
+	unsigned int grid_stamp;
+
+	// Reused by bfs_find: Points are seen in a BFS when their 'seen' is bfs_epoch.
+	unsigned int bfs_epoch;
+	vector<link_point*> bfs_queue;
+
+	void sweep(vector<link_point*> &events, vector<link_point*> &crossing);
+	int grid_col(xycoord_t x);
+	int grid_row(xycoord_t y);
+	void index_segment(link_point *lp);
+	link_point* first_in_scan(link_point *a, link_point *b);
+
 	bool walk_contour(contour_point &p1, contour_point &p2, link_point* &start, vector<link_point*> &out);
 	link_point* find(contour_point p,contour_point p_guide); // finds self and prev of seg below p.
 	link_point* bfs_find(contour_point p,contour_point p_guide,link_point* guide); // finds self and prev of seg below p.
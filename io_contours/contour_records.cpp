@@ -0,0 +1,149 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "contour_records.h"
+#include <cassert>
+
+using namespace terrastream;
+
+void terrastream::pack_contour(int label, const contour_point *points, size_t n, std::vector<packed_record> &out) {
+	out.resize(n*packed_encoder::MAX_RECORDS);
+	packed_encoder enc(label);
+	size_t r = 0;
+	for(size_t i = 0; i < n; i++) {
+		assert(points[i].label == label);
+		r += enc.encode(points[i], &out[r]);
+	}
+	out.resize(r);
+}
+
+void terrastream::unpack_contour(const contour_header &h, const packed_record *records, std::vector<contour_point> &out) {
+	out.resize(h.points);
+	packed_decoder dec(h.label);
+	int j = 0;
+	for(int i = 0; i < h.records; i++) {
+		if(dec.decode(records[i], out[j]))
+			j++;
+	}
+	assert(j == h.points);
+}
+
+contour_record_stream::contour_record_stream() : has_next(false), npoints(0) {}
+
+contour_record_stream::contour_record_stream(const std::string &headers_path, const std::string &blocks_path, ami::stream_type type) :
+	headers(headers_path, type), blocks(blocks_path, type), has_next(false), npoints(0) {
+	if(type == ami::WRITE_STREAM)
+		return;
+	// The points of the contours already in the files:
+	contour_header *h;
+	while(headers.read_item(&h) == NO_ERROR)
+		npoints += h->points;
+	headers.seek(0);
+}
+
+err contour_record_stream::write(const topology_edge &t, const contour_point *points, size_t n) {
+	pack_contour(t.c, points, n, buffer);
+	err e = headers.write_item(contour_header(t, (int)n, (int)buffer.size()));
+	if(e != NO_ERROR)
+		return e;
+	npoints += n;
+	return buffer.empty() ? NO_ERROR : blocks.write_array(&buffer[0], buffer.size());
+}
+
+err contour_record_stream::write(const topology_edge &t, const std::vector<contour_point> &points) {
+	return write(t, points.empty() ? NULL : &points[0], points.size());
+}
+
+err contour_record_stream::peek(const contour_header **h) {
+	if(!has_next) {
+		contour_header *r;
+		err e = headers.read_item(&r);
+		if(e != NO_ERROR)
+			return e;
+		next = *r;
+		has_next = true;
+	}
+	*h = &next;
+	return NO_ERROR;
+}
+
+err contour_record_stream::read(contour_header &h, std::vector<contour_point> &points) {
+	const contour_header *p;
+	err e = peek(&p);
+	if(e != NO_ERROR)
+		return e;
+	h = *p;
+	has_next = false;
+	buffer.resize(h.records);
+	if(h.records > 0) {
+		TPIE_OS_SIZE_T len = h.records;
+		e = blocks.read_array(&buffer[0], &len);
+		if(e != NO_ERROR)
+			return e;
+		assert(len == (TPIE_OS_SIZE_T)h.records);
+	}
+	unpack_contour(h, buffer.empty() ? NULL : &buffer[0], points);
+	return NO_ERROR;
+}
+
+void contour_record_stream::rewind() {
+	headers.seek(0);
+	blocks.seek(0);
+	has_next = false;
+}
+
+void contour_record_stream::truncate() {
+	headers.truncate(0);
+	blocks.truncate(0);
+	has_next = false;
+	npoints = 0;
+}
+
+err contour_record_queue::enqueue(const topology_edge &t, const std::vector<contour_point> &points) {
+	pack_contour(t.c, points.empty() ? NULL : &points[0], points.size(), buffer);
+	err e = headers.enqueue(contour_header(t, (int)points.size(), (int)buffer.size()));
+	for(size_t i = 0; i < buffer.size() && e == NO_ERROR; i++)
+		e = blocks.enqueue(buffer[i]);
+	return e;
+}
+
+err contour_record_queue::dequeue(contour_header &h, std::vector<contour_point> &points) {
+	const contour_header *p;
+	err e = headers.dequeue(&p);
+	if(e != NO_ERROR)
+		return e;
+	h = *p;
+	buffer.resize(h.records);
+	for(int i = 0; i < h.records; i++) {
+		const packed_record *r;
+		e = blocks.dequeue(&r);
+		if(e != NO_ERROR)
+			return e;
+		buffer[i] = *r;
+	}
+	unpack_contour(h, buffer.empty() ? NULL : &buffer[0], points);
+	return NO_ERROR;
+}
+
+void terrastream::to_records(stream<topology_edge> &topology, stream<contour_point> &segs, contour_record_stream &out) {
+	std::vector<contour_point> points;
+	topology_edge *t;
+	contour_point *p;
+	bool p_ok = segs.read_item(&p) == NO_ERROR;
+	while(topology.read_item(&t) == NO_ERROR) {
+		points.clear();
+		for(; p_ok && p->label == t->c; p_ok = segs.read_item(&p) == NO_ERROR)
+			points.push_back(*p);
+		out.write(*t, points);
+	}
+	assert(!p_ok); // All points belong to a contour of the topology.
+}
+
+void terrastream::to_points(contour_record_stream &in, stream<contour_point> &out) {
+	std::vector<contour_point> points;
+	contour_header h;
+	while(in.read(h, points) == NO_ERROR) {
+		if(!points.empty())
+			out.write_array(&points[0], points.size());
+	}
+}
@@ -0,0 +1,89 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_CONTOUR_RECORDS_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_CONTOUR_RECORDS_H__
+#include <terrastream/common/common.h>
+#include <tpie/stream.h>
+#include <tpie/queue.h>
+#include <vector>
+#include <string>
+#include "contour_types.h"
+#include "packed_contours.h"
+
+namespace terrastream{
+
+/*
+ * Contours stored as one record each: A header with the topology of the contour (label, parent
+ * and elevation) and its number of points, followed by a block of the points packed as in
+ * packed_contours.h. The label is only in the header, so a contour is read in one go instead of
+ * point by point until the label changes. Contours are in the order of the topology.
+ */
+struct contour_header {
+	int label, parent;
+	elev_t z;
+	int points;  // Of the contour.
+	int records; // Of the packed points.
+
+	contour_header() {}
+	contour_header(const topology_edge &t, int n, int r) : label(t.c), parent(t.p), z(t.c_z), points(n), records(r) {}
+	topology_edge topo() const { return topology_edge(label, parent, z); }
+};
+
+// Packs n points of the contour label to out (which is resized to the number of records).
+void pack_contour(int label, const contour_point *points, size_t n, std::vector<packed_record> &out);
+// Unpacks the records of the contour h to out (which is resized to h.points).
+void unpack_contour(const contour_header &h, const packed_record *records, std::vector<contour_point> &out);
+
+/*
+ * Stream of contour records. The header of peek is valid until the next call to peek or read.
+ */
+class contour_record_stream {
+public:
+	contour_record_stream();
+	// In the files headers_path and blocks_path, which are kept.
+	contour_record_stream(const std::string &headers_path, const std::string &blocks_path, ami::stream_type type);
+	err write(const topology_edge &t, const contour_point *points, size_t n);
+	err write(const topology_edge &t, const std::vector<contour_point> &points);
+	err peek(const contour_header **h);
+	// Reads the next contour with one read of its packed points.
+	err read(contour_header &h, std::vector<contour_point> &points);
+	// To the first contour.
+	void rewind();
+	void truncate();
+	TPIE_OS_OFFSET contours() { return headers.stream_len(); }
+	TPIE_OS_OFFSET points() const { return npoints; } // Written to this stream.
+	TPIE_OS_OFFSET records() { return blocks.stream_len(); } // Of the packed points.
+private:
+	stream<contour_header> headers;
+	stream<packed_record> blocks;
+	contour_header next;
+	bool has_next;
+	TPIE_OS_OFFSET npoints;
+	std::vector<packed_record> buffer;
+};
+
+/*
+ * Queue of contour records. Has the interface of contour_record_stream,
+ * with enqueue and dequeue for write and read.
+ */
+class contour_record_queue {
+public:
+	err enqueue(const topology_edge &t, const std::vector<contour_point> &points);
+	err peek(const contour_header **h) { return headers.peek(h); }
+	err dequeue(contour_header &h, std::vector<contour_point> &points);
+	bool is_empty() { return headers.is_empty(); }
+private:
+	ami::queue<contour_header> headers;
+	ami::queue<packed_record> blocks;
+	std::vector<packed_record> buffer;
+};
+
+// The contours of topology and segs to out. segs must be sorted by label in the order of
+// topology, as after order_for_simplification. Leaves the streams at their end.
+void to_records(stream<topology_edge> &topology, stream<contour_point> &segs, contour_record_stream &out);
+// The points of in to out, sorted by label as segs of to_records. Leaves the streams at their end.
+void to_points(contour_record_stream &in, stream<contour_point> &out);
+
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_CONTOUR_RECORDS_H__*/
@@ -4,6 +4,7 @@
 #include "contours.h"
 #include "intersect.h"
 #include "ridge_removal.h"
+#include "segment_labelling.h"
 #include "outer_curves.h"
 #include <terrastream/common/labelling.h>
 #include "cw_ordering.h"
@@ -23,9 +24,8 @@ typedef contour_point cp;
 
 void terrastream::compute_contours(stream<triangle> &tris,
 								   elev_t gran,
-								   stream<cp> &out_segs,
-								   stream<topo> &out_topo) {
-	compute_contours(tris,gran,0.0f,out_segs,out_topo);
+								   contour_record_stream &out) {
+	compute_contours(tris,gran,0.0f,out);
 }
 
 // sets x,y to the common point of own and other if set_common, 
@@ -110,46 +110,23 @@ void print_labelling_segs_in_region(stream<labelling_signed_contour_segment> &se
 	segs.seek(0);
 }
 
-void terrastream::compute_contours(stream<triangle> &tris,
-								   elev_t gran,float z_diff,
-								   stream<cp> &o_segs,
-								   stream<topo> &out_topo) {
-  //Prepare
-  tris.seek(0);
-  o_segs.truncate(0);
-  out_topo.truncate(0);
-
-  //Intersect triangulation
-  
-  stream<ss> segs;
-
-  map_info inf = intersect(tris,gran,z_diff,segs);
-  segs.seek(0);
-//  cerr << "After intersect:" << endl;
-//  print_segs_in_region(segs);
-
-  //Remove duplicates
-  stream<labelling_signed_contour_segment> no_duplets;
-  remove_ridges_and_duplets(segs,no_duplets);
-  segs.truncate(0);
-
-  cerr << "#seg After remove ridges and duplets: " << no_duplets.stream_len() << endl;
-//  print_labelling_segs_in_region(no_duplets);
-
-  //Add the outer contours
-  add_outer_curves(tris,gran,inf,no_duplets);
-  no_duplets.seek(0);
-
+void label_and_order(stream<labelling_signed_contour_segment> &no_duplets,
+					 contour_record_stream &out) {
   cerr << "#segs after add outer curves:" << no_duplets.stream_len() << endl;
   //print_labelling_segs_in_region(no_duplets);
 
   //Label the segments
   stream<lss> lbl;
-  Labelling<labelling_signed_contour_segment, xycoord_t> l;
-  
-  tflow_progress dummy("DUMMY", "DUMMY:",0,1,1);
+  if (fits_in_memory_labelling(no_duplets)) {
+	label_segments_in_memory(no_duplets, lbl);
+  }
+  else {
+	Labelling<labelling_signed_contour_segment, xycoord_t> l;
 
-  l.label<lss, DummyLabel<segment_point>, DummyCH>(no_duplets, &lbl, NULL, NULL, dummy);
+	tflow_progress dummy("DUMMY", "DUMMY:",0,1,1);
+
+	l.label<lss, DummyLabel<segment_point>, DummyCH>(no_duplets, &lbl, NULL, NULL, dummy);
+  }
 
   lbl.seek(0);
 //  cerr << "After labelling:" << endl;
@@ -175,6 +152,7 @@ void terrastream::compute_contours(stream<triangle> &tris,
   cerr << "cc- build topo" << endl;
 #endif
   //Compute topology
+  stream<topo> out_topo;
   stream<rlss> out_segs2;
   relabel(out_segs,out_segs2);
   out_segs2.seek(0);
@@ -188,6 +166,64 @@ void terrastream::compute_contours(stream<triangle> &tris,
   o_segs2.seek(0);
 
   // make real output:
-  order_for_simplification(out_topo, o_segs2, o_segs);
+  order_for_simplification(out_topo, o_segs2, out);
   o_segs2.truncate(0);
+  out_topo.truncate(0);
+}
+
+void terrastream::compute_contours(stream<triangle> &tris,
+								   elev_t gran,float z_diff,
+								   contour_record_stream &out,
+								   bool snap) {
+  //Prepare
+  tris.seek(0);
+  out.truncate();
+
+  //Intersect triangulation
+  
+  stream<ss> segs;
+
+  map_info inf = intersect(tris,gran,z_diff,segs,snap);
+  segs.seek(0);
+//  cerr << "After intersect:" << endl;
+//  print_segs_in_region(segs);
+
+  //Remove duplicates
+  stream<labelling_signed_contour_segment> no_duplets;
+  remove_ridges_and_duplets(segs,no_duplets);
+  segs.truncate(0);
+
+  cerr << "#seg After remove ridges and duplets: " << no_duplets.stream_len() << endl;
+//  print_labelling_segs_in_region(no_duplets);
+
+  //Add the outer contours
+  add_outer_curves(tris,gran,inf,no_duplets);
+  no_duplets.seek(0);
+
+  label_and_order(no_duplets,out);
+}
+
+void terrastream::compute_contours(stream<ss> &segs,
+								   stream<endpoint_segment> &boundary,
+								   map_info &inf,
+								   elev_t gran,
+								   contour_record_stream &out) {
+  //Prepare
+  out.truncate();
+  segs.seek(0);
+
+  //Remove duplicates
+  stream<labelling_signed_contour_segment> no_duplets;
+  remove_ridges_and_duplets_in_rows(segs,no_duplets);
+  segs.truncate(0);
+
+  cerr << "#seg After remove ridges and duplets: " << no_duplets.stream_len() << endl;
+
+  //Add the outer contours
+  boundary.seek(0);
+  add_outer_curves(boundary,gran,inf,no_duplets);
+  boundary.truncate(0);
+  no_duplets.seek(0);
+
+  label_and_order(no_duplets,out);
 }
@@ -8,6 +8,8 @@
 #include <tpie/portability.h>
 #include <tpie/stream.h>
 #include "contour_types.h"
+#include "contour_records.h"
+#include "outer_curves.h"
 #include <terrastream/common/tflow_types.h>
 #include <terrastream/common/wlabel.h>
 #include <terrastream/common/labelling.h>
@@ -81,18 +83,29 @@ bool assert_eq(stream<A> &a, stream<B> &b) {
 	return false;
 }
 
+// The contours are written to out as contour records in the order of order_for_simplification.
 void compute_contours(stream<triangle> &triangulation,
 					  elev_t granularity,
-					  stream<contour_point> &out_segs,
-					  stream<topology_edge> &out_topo);
+					  contour_record_stream &out);
 
 // Computes contours with heights of the given granularity, and for every height t, contours for heights
-//t-z_diff and t+z_diff are added as well.
+//t-z_diff and t+z_diff are added as well. snap is passed to intersect.
 void compute_contours(stream<triangle> &triangulation,
 					  elev_t granularity,
 					  float z_diff,
-					  stream<contour_point> &out_segs,
-					  stream<topology_edge> &out_topo);
+					  contour_record_stream &out,
+					  bool snap = false);
+
+// Computes contours from segments that have already been intersected (as by intersect in intersect.h),
+// for producers that never materialize the triangulation. boundary holds the boundary edges of the
+// triangulation (see add_outer_curves) and inf the map_info of the triangulation.
+// segs must come from a unit grid in row order (see remove_ridges_and_duplets_in_rows).
+// segs and boundary are consumed.
+void compute_contours(stream<signed_contour_segment> &segs,
+					  stream<endpoint_segment> &boundary,
+					  map_info &inf,
+					  elev_t granularity,
+					  contour_record_stream &out);
 
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_CONTOURS_H__*/
@@ -2,11 +2,16 @@
 // vi:set ts=4 sts=4 sw=4 noet :
 
 #include "cw_ordering.h"
+#include "point_index.h"
+#include "worker_threads.h"
 #include <terrastream/common/sort.h>
 #include <vector>
 #include <queue>
 #include <map>
 #include <utility>
+#include <deque>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 using namespace terrastream;
 using namespace tpie;
@@ -33,12 +38,6 @@ struct order_for_augment{
   }
 };
 
-struct ep{
-	pt p;
-	vector<pair<CW_SIZE_T,CW_SIZE_T> > ns; // adjacent point, seg index in contour
-	ep(pt _p) : p(_p) {}
-};
-
 /*void write_contour(vector<lss> &contour,vector<CW_SIZE_T> &segs, int label, stream<rlss> &out) {
   order_for_augment cmp;
   //Check for real segments and start the contours at the leftmost segment
@@ -55,47 +54,43 @@ struct ep{
   int ranks = 0;
   for (CW_SIZE_T i=first;i<segs.size();i++) {
 	lss &l = contour[segs[i]];
-	out.write_item(rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
+	write_rlss(out,rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
 //	cerr << " " << l << std::endl;
   }
   for (CW_SIZE_T i=0;i<first;i++) {
 	lss &l = contour[segs[i]];
-	out.write_item(rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
+	write_rlss(out,rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
 //	cerr << " " << l << std::endl;
   }
   }*/
 
 const xycoord_t PI = acos(-1.0);
 
-void build_eps(vector<ep> &eps, vector<lss> &contour) {
-	map<pt,CW_SIZE_T> ep_map; // pt: pair<xycoord_t,xycoord_t>, ep_map: point->index
+void build_eps(point_index &eps, vector<lss> &contour) {
+	eps.clear();
 	for (CW_SIZE_T i=0;i<contour.size();i++) {
 		lss &l = contour[i];
-		pt p1 = pt(l.x1,l.y1);
-		pt p2 = pt(l.x2,l.y2);
-		for (int j=0;j<2;j++) {
-			pt cur = j==0 ? p1 : p2;
-			if (ep_map.count(cur)==0) {
-				eps.push_back(ep(cur)); // ns not set.
-				ep_map[cur]=eps.size()-1; // set index
-			}
-		}
-		CW_SIZE_T ip1 = ep_map[p1];
-		CW_SIZE_T ip2 = ep_map[p2];
-		eps[ip1].ns.push_back(make_pair(ip2,i));
-		eps[ip2].ns.push_back(make_pair(ip1,i));
+		CW_SIZE_T ip1 = eps.insert(l.x1,l.y1);
+		CW_SIZE_T ip2 = eps.insert(l.x2,l.y2);
+		eps.add_edge(ip1,ip2,i);
 	}
+	eps.build_adjacency();
 }
 
 //Sort neighbors of nodes of degree > 2 (in clockwise order)
-void order_points(vector<ep> &eps) {
+void order_points(point_index &eps) {
+	vector<pair<xycoord_t,CW_SIZE_T> > tmp; // cos, index. Equal angles keep the order of the indices.
+	vector<point_index::neighbour> old_ns;
 	for (CW_SIZE_T i=0;i<eps.size();i++) {
-		if (eps[i].ns.size()>2) {
-			vector<pair<xycoord_t,CW_SIZE_T> > tmp; // cos, index.
-			for (CW_SIZE_T j=0;j<eps[i].ns.size();j++) {
-				pair<CW_SIZE_T,CW_SIZE_T> n = eps[i].ns[j];
-				xycoord_t dx = eps[n.first].p.first-eps[i].p.first;
-				xycoord_t dy = eps[n.first].p.second-eps[i].p.second;
+		if (eps.degree(i)>2) {
+			point_index::neighbour *ns = eps.neighbours(i);
+			const segment_point &p = eps.point(i);
+			tmp.clear();
+			old_ns.assign(ns,ns+eps.degree(i));
+			for (CW_SIZE_T j=0;j<eps.degree(i);j++) {
+				const segment_point &q = eps.point(ns[j].first);
+				xycoord_t dx = q.x-p.x;
+				xycoord_t dy = q.y-p.y;
 				xycoord_t l = sqrt(dx*dx+dy*dy);
 				dx/=l;
 				xycoord_t acos_r = acos(dx);
@@ -107,11 +102,9 @@ void order_points(vector<ep> &eps) {
 				tmp.push_back(make_pair(acos_r,j));
 			}
 			sort(tmp.begin(),tmp.end());
-			vector<pair<CW_SIZE_T,CW_SIZE_T> > new_ns;
 			for (CW_SIZE_T j=0;j<tmp.size();j++) {
-				new_ns.push_back(eps[i].ns[tmp[j].second]);
+				ns[j]=old_ns[tmp[j].second];
 			}
-			eps[i].ns=new_ns; // TODO: Actually updated?
 		}
 	}
 }
@@ -226,7 +219,19 @@ void order_points(vector<ep> &eps) {
 	}
 	}*/
 
-void write_contour(vector<lss> &contour, int &label, stream<rlss> &out) {
+static const CW_SIZE_T CW_BATCH_SEGMENTS = 1<<16; // Segments read per batch of contours in the parallel cw_order.
+static const CW_SIZE_T CW_BATCHES_PER_THREAD = 4; // Batches in flight per worker thread.
+
+inline void write_rlss(stream<rlss> &out, const rlss &l) {
+	out.write_item(l);
+}
+
+inline void write_rlss(vector<rlss> &out, const rlss &l) {
+	out.push_back(l);
+}
+
+template<typename O>
+void write_contour(vector<lss> &contour, int &label, O &out) {
 	//Check for real segments and start the contours at the leftmost segment
 	bool has_real=false;
 	int first=0;
@@ -241,7 +246,7 @@ void write_contour(vector<lss> &contour, int &label, stream<rlss> &out) {
 
 	if (!has_real) {
 #ifdef DEBUG_CW_ORDERING
-		cerr << "Contour " << label << " without real segment. Not output." << endl;
+		cerr << "Contour " << contour[0].label << " (input label) without real segment. Not output." << endl;
 #endif
 		return;
 	}
@@ -275,14 +280,14 @@ void write_contour(vector<lss> &contour, int &label, stream<rlss> &out) {
 		int ranks = 0;
 		for (int i=first;i>=0;--i) {
 			lss &l = contour[i];
-			out.write_item(rlss(l.x2,l.y2,l.x1,l.y1,l.z,l.sign,label,ranks++));
+			write_rlss(out,rlss(l.x2,l.y2,l.x1,l.y1,l.z,l.sign,label,ranks++));
 #ifdef DEBUG_CW_ORDERING
 			cerr << " " << l << endl;
 #endif
 		}
 		for (int i=contour.size()-1;i>first;--i) {
 			lss &l = contour[i];
-			out.write_item(rlss(l.x2,l.y2,l.x1,l.y1,l.z,l.sign,label,ranks++));
+			write_rlss(out,rlss(l.x2,l.y2,l.x1,l.y1,l.z,l.sign,label,ranks++));
 			cerr << " " << l << std::endl;
 		}
 	}
@@ -296,11 +301,11 @@ void write_contour(vector<lss> &contour, int &label, stream<rlss> &out) {
 #ifdef DEBUG_CW_ORDERING
 			cerr << " " << l << std::endl;
 #endif
-			out.write_item(rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
+			write_rlss(out,rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
 		}
 		for (CW_SIZE_T i=0;i<first;i++) {
 			lss &l = contour[i];
-			out.write_item(rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
+			write_rlss(out,rlss(l.x1,l.y1,l.x2,l.y2,l.z,l.sign,label,ranks++));
 #ifdef DEBUG_CW_ORDERING
 			cerr << " " << l << std::endl;
 #endif
@@ -310,7 +315,8 @@ void write_contour(vector<lss> &contour, int &label, stream<rlss> &out) {
 	label++;
 }
 
-void order_contour2(vector<lss> &contour,int &label, stream<rlss> &out) {
+template<typename O>
+void order_contour2(vector<lss> &contour,int &label, O &out, point_index &eps) {
 #ifdef DEBUG_CW_ORDERING
 	if(!contour.empty()) {
 		cerr << "Ordering contour at " << contour[0].z << " of size " << contour.size() << endl;
@@ -319,40 +325,28 @@ void order_contour2(vector<lss> &contour,int &label, stream<rlss> &out) {
 		}
 	}
 #endif
-	//Build the graph
-	vector<ep> eps; // ep: p=pt point, ns=vector(unref neighbour index,seg index in contour)
+	//Build the graph: points with the (cw ordered) segments around them
 	build_eps(eps, contour);
 
 	//Sort neighbors of nodes of degree > 2 (in clockwise order)
 	order_points(eps);
 
-	// Graph needed for simple alg.:
-	map<pt,vector<CW_SIZE_T> > neighbour_info; // pt -> neighbours
-	for(vector<ep>::iterator it = eps.begin(); it != eps.end(); ++it) {
-		ep point_info = *it;
-		vector<CW_SIZE_T> ns2;
-		vector<pair<CW_SIZE_T,CW_SIZE_T> >::iterator it2;
-		for(it2 = point_info.ns.begin(); it2 != point_info.ns.end(); ++it2) {
-			ns2.push_back(it2->second);
-		}
-		if(ns2.size() % 2 == 1) {
-			cerr << "Error: Input error to cw_ordering. Contour " << label << " with node of degree " << ns2.size() << endl;						
+	for(CW_SIZE_T i = 0; i < eps.size(); i++) {
+		if(eps.degree(i) % 2 == 1) {
+			cerr << "Error: Input error to cw_ordering. Contour " << contour[0].label << " (input label) with node of degree " << eps.degree(i) << endl;						
 			cerr << "Warning: Contour removed from input. " << endl;			
 			return;
 		}
-//		assert(ns2.size() % 2 == 0);
-		neighbour_info[point_info.p] = ns2;
 	}
-	eps.clear(); // clear space.
 
 #ifdef DEBUG_CW_ORDERING
-	cerr << "Data structure neighbour_info built ||=" << neighbour_info.size() << endl;
-	for(map<pt,vector<CW_SIZE_T> >::iterator it = neighbour_info.begin(); it != neighbour_info.end(); ++it) {
-			if(it->second.size() == 2)
+	cerr << "Data structure neighbour_info built ||=" << eps.size() << endl;
+	for(CW_SIZE_T i = 0; i < eps.size(); i++) {
+			if(eps.degree(i) == 2)
 				continue;
-			cerr << " " << it->first.first << "," << it->first.second << ": ";
-			for(vector<CW_SIZE_T>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
-				cerr << "," << *it2;
+			cerr << " " << eps.point(i).x << "," << eps.point(i).y << ": ";
+			for(CW_SIZE_T j = 0; j < eps.degree(i); j++) {
+				cerr << "," << eps.neighbours(i)[j].second;
 			}
 			cerr << endl;
 	}
@@ -387,36 +381,32 @@ void order_contour2(vector<lss> &contour,int &label, stream<rlss> &out) {
 			// find next:
 			CW_SIZE_T next; // next seg.
 			pt p2 = make_pair(seg.x2,seg.y2);
-			vector<CW_SIZE_T> p2n = neighbour_info[p2];
-			if (p2n.size()!=2) {
+			CW_SIZE_T ip2 = eps.find(seg.x2,seg.y2);
+			assert(ip2 != point_index::NONE);
+			point_index::neighbour *p2n = eps.neighbours(ip2);
+			CW_SIZE_T p2n_size = eps.degree(ip2);
+			if (p2n_size!=2) {
 				//Find self
 				CW_SIZE_T cur;
-				for(CW_SIZE_T i = 0; i < p2n.size(); i++) {
-					if(p2n[i] == contour_index) {
+				for(CW_SIZE_T i = 0; i < p2n_size; i++) {
+					if(p2n[i].second == contour_index) {
 						cur = i;
 						break;
 					}
 				}
-				next = p2n[(cur+1)%p2n.size()];
+				next = p2n[(cur+1)%p2n_size].second;
 				// Update multiple fanout node:
-				vector<CW_SIZE_T> np2n;
-				for(CW_SIZE_T i = 0; i < p2n.size(); i++) {
-					if(!(i == cur || i == (cur+1)%p2n.size())) {
-						np2n.push_back(p2n[i]);
-					}
-				}
-				assert(np2n.size() == p2n.size()-2);
-				neighbour_info[p2] = np2n;
-				assert(neighbour_info[p2].size() == np2n.size());
+				eps.erase_neighbours(ip2, cur, (cur+1)%p2n_size);
+				assert(eps.degree(ip2) == p2n_size-2);
 #ifdef DEBUG_CW_ORDERING
 				cerr << "Point " << p2.first << "," << p2.second << " now with neighbours: ";
-				for(vector<CW_SIZE_T>::iterator it3 = np2n.begin(); it3 != np2n.end(); ++it3) {
-					cerr << "," << *it3;
+				for(CW_SIZE_T i = 0; i < eps.degree(ip2); i++) {
+					cerr << "," << p2n[i].second;
 				}
 				cerr << endl;
 #endif
 			} else { //This is a normal node with two neighbors
-				next = p2n[0] == contour_index ? p2n[1] : p2n[0];				
+				next = p2n[0].second == contour_index ? p2n[1].second : p2n[0].second;				
 			}
 #ifdef DEBUG_CW_ORDERING
 			cerr << "Going to " << next << " (" << contour[next] << ")" << endl;
@@ -462,7 +452,141 @@ void terrastream::print_stream_status(stream<lss> &in) {
   in.seek(0);
 }
 
-void terrastream::cw_order(stream<lss> &in,stream<rlss> &out) {
+// Contours ordered together by a worker of the parallel cw_order. Labels in out start at 0, 
+// so messages of the workers name contours by their input label.
+struct cw_batch {
+	vector<vector<lss> > contours;
+	vector<rlss> out;
+	int labels;
+	bool done;
+	cw_batch() : labels(0), done(false) {}
+};
+
+// State shared by the reader, the workers and the writer of the parallel cw_order.
+struct cw_pipeline {
+	boost::mutex m;
+	boost::condition_variable cond;
+	deque<cw_batch*> todo;     // Batches not yet taken by a worker.
+	deque<cw_batch*> inflight; // All batches not yet written, in input order.
+	size_t max_inflight;
+	bool read_done;
+	bool too_large;
+	cw_pipeline(size_t _max_inflight) : max_inflight(_max_inflight), read_done(false), too_large(false) {}
+};
+
+// Reader: Splits the sorted input into batches of whole contours.
+void cw_read(cw_pipeline *p, stream<lss> *in) {
+	lss* t;
+	err ae = in->read_item(&t);
+	tflow_progress progress("Performing clockwise ordering of segments", "Performing clockwise ordering of segments", 0, in->stream_len(), 1);
+	while (ae==NO_ERROR) {
+		cw_batch *b = new cw_batch();
+		CW_SIZE_T batch_size = 0;
+		while (ae==NO_ERROR && batch_size < CW_BATCH_SEGMENTS) {
+			b->contours.push_back(vector<lss>());
+			vector<lss> &contour = b->contours.back();
+			contour.push_back(*t);
+			while ((ae=in->read_item(&t))==NO_ERROR && t->label==contour[0].label) {
+				progress.step();
+				contour.push_back(*t);
+			}
+			if (contour.size() > std::numeric_limits<CW_SIZE_T>::max()) {
+				boost::mutex::scoped_lock lock(p->m);
+				p->too_large = true;
+				b->contours.pop_back();
+				ae = END_OF_STREAM;
+				break;
+			}
+			batch_size += contour.size();
+		}
+		boost::mutex::scoped_lock lock(p->m);
+		while (p->inflight.size() >= p->max_inflight)
+			p->cond.wait(lock);
+		p->todo.push_back(b);
+		p->inflight.push_back(b);
+		p->cond.notify_all();
+	}
+	progress.done();
+	boost::mutex::scoped_lock lock(p->m);
+	p->read_done = true;
+	p->cond.notify_all();
+}
+
+// Worker: Orders the contours of one batch at a time.
+void cw_work(cw_pipeline *p) {
+	point_index eps;
+	while (true) {
+		cw_batch *b;
+		{
+			boost::mutex::scoped_lock lock(p->m);
+			while (p->todo.empty() && !p->read_done)
+				p->cond.wait(lock);
+			if (p->todo.empty())
+				return;
+			b = p->todo.front();
+			p->todo.pop_front();
+		}
+		for (size_t i=0;i<b->contours.size();i++)
+			order_contour2(b->contours[i],b->labels,b->out,eps);
+		b->contours.clear();
+		boost::mutex::scoped_lock lock(p->m);
+		b->done = true;
+		p->cond.notify_all();
+	}
+}
+
+void terrastream::cw_order(stream<lss> &in,stream<rlss> &out,unsigned int threads) {
+  if (in.stream_len()==0) return;
+  threads = worker_threads(threads);
+  if (threads == 1) {
+	  cw_order_serial(in,out);
+	  return;
+  }
+  cout << "Sorting contours into clockwise order using " << threads << " threads\n";
+  cout << "Assuming a single contour fits in memory\n";
+
+  //Sort
+  order_for_augment cmp;
+  in.seek(0);
+  ts_sort(&in,&cmp);
+  in.seek(0);
+
+  cw_pipeline p(CW_BATCHES_PER_THREAD*threads);
+  boost::thread reader(boost::bind(&cw_read, &p, &in));
+  boost::thread_group workers;
+  for (unsigned int i=0;i<threads;i++)
+	  workers.create_thread(boost::bind(&cw_work, &p));
+
+  //Write the batches in input order, offsetting their labels as if ordered one by one
+  int label = 0;
+  while (true) {
+	cw_batch *b;
+	{
+		boost::mutex::scoped_lock lock(p.m);
+		while (!(p.inflight.empty() ? p.read_done : p.inflight.front()->done))
+			p.cond.wait(lock);
+		if (p.inflight.empty())
+			break;
+		b = p.inflight.front();
+		p.inflight.pop_front();
+		p.cond.notify_all();
+	}
+	for (size_t i=0;i<b->out.size();i++) {
+		rlss &l = b->out[i];
+		l.label += label;
+		out.write_item(l);
+	}
+	label += b->labels;
+	delete b;
+  }
+  reader.join();
+  workers.join_all();
+  if (p.too_large)
+	throw std::runtime_error("Too many segments in contour, redefine CW_SIZE_T to larger type and recompile");
+  cout << "Done cw-ordering.\n";
+}
+
+void terrastream::cw_order_serial(stream<lss> &in,stream<rlss> &out) {
   if (in.stream_len()==0) return;
   cout << "Sorting contours into clockwise order\n";
   cout << "Assuming a single contour fits in memory\n";
@@ -478,6 +602,7 @@ void terrastream::cw_order(stream<lss> &in,stream<rlss> &out) {
 
   //Retrieve single contours
   vector<lss> contour;
+  point_index eps;
   lss* t;
   err ae = in.read_item(&t);
   int label = 0;
@@ -497,7 +622,7 @@ void terrastream::cw_order(stream<lss> &in,stream<rlss> &out) {
 	if (contour.size() > std::numeric_limits<CW_SIZE_T>::max())
 		throw std::runtime_error("Too many segments in contour, redefine CW_SIZE_T to larger type and recompile");
 	//Process it if it has a real segment
-	order_contour2(contour,label,out);
+	order_contour2(contour,label,out,eps);
 	
 	//Advance to next contour...
   }
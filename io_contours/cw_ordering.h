@@ -17,8 +17,14 @@ namespace terrastream{
    * This step also removes the last type of degeneracy, namely contours intersecting in a single
    * point. Such contours are split into separate contours with their own labels. Furtermore, all
    * contours consisting completely of outer segments will be removed.
+   * The contours are ordered by threads worker threads (0: one per core, see worker_threads.h) while
+   * the input is read and the output written by two more, each on a stream of its own. The output
+   * does not depend on the number of threads.
    */
-  void cw_order(stream<labelled_signed_contour_segment> &ls,stream<ranked_labelled_signed_contour_segment> &out);
+  void cw_order(stream<labelled_signed_contour_segment> &ls,stream<ranked_labelled_signed_contour_segment> &out,unsigned int threads = 0);
+
+  // cw_order on a single thread.
+  void cw_order_serial(stream<labelled_signed_contour_segment> &ls,stream<ranked_labelled_signed_contour_segment> &out);
 
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_CW_ORDERING_H__*/
@@ -2,14 +2,22 @@
 // vi:set ts=4 sts=4 sw=4 noet :
 
 #include "intersect.h"
+#include "packed_contours.h"
 #include <cmath>
 #include <algorithm>
+#include <vector>
 
 using namespace std;
 using namespace tpie;
 using namespace terrastream;
 
-inline void update_map_info(map_info &m,triangle *t) {
+void terrastream::init_map_info(map_info &m,triangle *t) {
+	m.minX=m.maxX=t->points[0].x;
+	m.minY=m.maxY=t->points[0].y;
+	m.minZ=m.maxZ=t->points[0].z;
+}
+
+void terrastream::update_map_info(map_info &m,triangle *t) {
 	for (int i=0;i<3;i++) {
 		m.minX = min(t->points[i].x,m.minX);
 		m.maxX = max(t->points[i].x,m.maxX);
@@ -25,11 +33,57 @@ map_info terrastream::intersect(stream<triangle> &in,elev_t gran,
 	return intersect(in,gran,0.0f,out);
 }
 
+inline void write_segment(stream<signed_contour_segment> &out,signed_contour_segment const &s) {
+	out.write_item(s);
+}
+
+inline void write_segment(segment_buffer &out,signed_contour_segment const &s) {
+	out.push_back(s);
+}
+
+/*
+  The edges of a triangle prepared for interpolation: Edge a goes from vertex a to vertex (a+1)%3,
+  and min_p/max_p are its endpoints in point order. These are shared by all levels intersecting the
+  triangle, so they are only computed once per triangle. With snap, the interpolated points are
+  snapped to the lattice, which gives the same point for an edge shared by two triangles.
+*/
+struct triangle_edges {
+	int min_p[3], max_p[3];
+	double dz[3];
+	xycoord_t dx[3], dy[3];
+	bool snap;
+
+	triangle_edges(triangle *t,elev_t *zs,bool s) : snap(s) {
+		for (int a=0;a<3;a++) {
+			int b = (a+1)%3;
+			min_p[a] = a;
+			max_p[a] = b;
+			if (t->points[b] < t->points[a])
+				swap(min_p[a], max_p[a]);
+			dz[a] = double(zs[max_p[a]]-zs[min_p[a]]);
+			dx[a] = t->points[max_p[a]].x - t->points[min_p[a]].x;
+			dy[a] = t->points[max_p[a]].y - t->points[min_p[a]].y;
+		}
+	}
+
+	//Computes the point where the plane at pz crosses edge a
+	inline void interpolate(int a,elev_t pz,triangle *t,elev_t *zs,xycoord_t &hx,xycoord_t &hy) const {
+		double h = (double(pz-zs[min_p[a]])/dz[a]);
+		hx = t->points[min_p[a]].x+h*dx[a];
+		hy = t->points[min_p[a]].y+h*dy[a];
+		if (snap) {
+			hx = snap_to_lattice(hx);
+			hy = snap_to_lattice(hy);
+		}
+	}
+};
+
 /*
   Intersect the triangle t at the elevation pz.
 */
+template<typename O>
 inline void intersect_once(elev_t pz, elev_t minz, elev_t maxz,triangle* t,elev_t *zs,
-						   stream<signed_contour_segment> &out) {
+						   triangle_edges const &e,O &out) {
 	if (pz < minz || pz > maxz) {
 		return;
 	}
@@ -40,35 +94,25 @@ inline void intersect_once(elev_t pz, elev_t minz, elev_t maxz,triangle* t,elev_
 	if (hit_cnt==2) {
 		//The contour lies on an edge.
 		//Find the vertex not hit.
-		int not_hit;
-		for (int i=0;i<3;i++)
-			if (i!=hit_vertex[0] && i!=hit_vertex[1]) not_hit=i;
+		int not_hit = 3-hit_vertex[0]-hit_vertex[1];
 		//Create the contour segment
 		signed_contour_segment s(t->points[hit_vertex[0]].x,t->points[hit_vertex[0]].y,
 								 t->points[hit_vertex[1]].x,t->points[hit_vertex[1]].y,
 								 pz,t->points[not_hit].z<pz);
-		out.write_item(s);
+		write_segment(out,s);
 	} else if (hit_cnt==1) {
 		if (pz==minz || pz==maxz) return; //Just a single point contour
 		//The middle point got hit.
-		//Find between which two points a and b, the triangle got hit as well.
-		int a=0;
-		int b;
-		for (;a<3;a++) {
-			b = (a+1)%3;
-			if (zs[a]==pz || zs[b]==pz) continue;
-			break;
-		}
+		//The triangle got hit as well on the edge opposite of it.
+		int a = (hit_vertex[0]+1)%3;
 		//Compute hitting point by linear interpolation
-		int min_p = a, max_p = b;
-		if (t->points[max_p] < t->points[min_p])
-			swap(max_p, min_p);
-		double h = (double(pz-zs[min_p])/double(zs[max_p]-zs[min_p]));
-		xycoord_t hx = t->points[min_p].x+h*(t->points[max_p].x - t->points[min_p].x);
-		xycoord_t hy = t->points[min_p].y+h*(t->points[max_p].y - t->points[min_p].y);
+		xycoord_t hx, hy;
+		e.interpolate(a,pz,t,zs,hx,hy);
+		if (e.snap && hx==t->points[hit_vertex[0]].x && hy==t->points[hit_vertex[0]].y)
+			return; //Snapped onto the vertex
 		//Create the contour segment
 		signed_contour_segment s(t->points[hit_vertex[0]].x,t->points[hit_vertex[0]].y,hx,hy,pz);
-		out.write_item(s);
+		write_segment(out,s);
 	} else {
 		//No points got hit
 		xycoord_t hxs[2];
@@ -79,22 +123,94 @@ inline void intersect_once(elev_t pz, elev_t minz, elev_t maxz,triangle* t,elev_
 			int b = (a+1)%3;
 			if ((pz-zs[a])*(pz-zs[b])>0)
 				continue; //Both points are on same side of contour
-			int min_p = a, max_p = b;
-			if (t->points[max_p] < t->points[min_p])
-				swap(max_p, min_p);
-			double h = (double(pz-zs[min_p])/double(zs[max_p]-zs[min_p]));
-			hxs[hits] = t->points[min_p].x+h*(t->points[max_p].x - t->points[min_p].x);
-			hys[hits] = t->points[min_p].y+h*(t->points[max_p].y - t->points[min_p].y);
+			e.interpolate(a,pz,t,zs,hxs[hits],hys[hits]);
 			hits++;
 		}
+		if (e.snap && hxs[0]==hxs[1] && hys[0]==hys[1])
+			return; //Snapped onto a single point
 		//Create the contour segment
 		signed_contour_segment s(hxs[0],hys[0],hxs[1],hys[1],pz);
-		out.write_item(s);
+		write_segment(out,s);
 	}
 }
 
+//True if none of the planes pz+offsets[i] hit the interval [minz;maxz]
+inline bool misses(elev_t pz,elev_t *offsets,int n_offsets,elev_t minz,elev_t maxz) {
+	for (int i=0;i<n_offsets;i++) {
+		elev_t z = pz+offsets[i];
+		if (z >= minz && z <= maxz)
+			return false;
+	}
+	return true;
+}
+
+/*
+  Intersect the triangle t with all the planes crossing it in one pass. Every level hs*gran is
+  intersected at the offsets (0 or +-z_diff) in the order below. The first and last levels
+  hitting the triangle are found up front, so only levels producing segments are visited.
+*/
+template<typename O>
+inline void intersect_all(triangle *t,elev_t gran,float z_diff,O &out,bool snap) {
+	elev_t zs[3];
+	for (int i=0;i<3;i++) zs[i]=t->points[i].z;
+	elev_t minz = min(min(zs[0],zs[1]),zs[2]);
+	elev_t maxz = max(max(zs[0],zs[1]),zs[2]);
+	if (minz==maxz) return; //Flat triangles gives no contours
+
+	//Offsets of the planes intersected around every level:
+	elev_t offsets[3];
+	int n_offsets = 0;
+	if (z_diff > 0 && 2*z_diff <= gran) {
+		if(2*z_diff < gran) {
+			for (int i=-1;i<2;i++) {
+				offsets[n_offsets++] = i*z_diff;
+			}
+		}
+		else {
+			offsets[n_offsets++] = 0;
+			offsets[n_offsets++] = -z_diff;
+		}
+	}
+	else {
+		offsets[n_offsets++] = 0;
+	}
+
+	//Find the first and last level hitting the triangle:
+	elev_t const top = maxz+gran;
+	int first = int(ceil(minz/gran))-1;
+	while (first*gran <= top && misses(first*gran,offsets,n_offsets,minz,maxz))
+		first++;
+	if (first*gran > top)
+		return;
+	int last = int(floor(top/gran));
+	while (last*gran > top)
+		last--;
+	while ((last+1)*gran <= top)
+		last++;
+	while (last > first && misses(last*gran,offsets,n_offsets,minz,maxz))
+		last--;
+
+	triangle_edges e(t,zs,snap);
+	for (int hs=first;hs<=last;hs++) {
+		elev_t pz = hs*gran;
+		for (int i=0;i<n_offsets;i++) {
+			intersect_once(pz+offsets[i],minz,maxz,t,zs,e,out);
+		}
+	}
+}
+
+void terrastream::intersect_triangle(triangle *t,elev_t gran,float z_diff,
+									 stream<signed_contour_segment> &out,bool snap) {
+	intersect_all(t,gran,z_diff,out,snap);
+}
+
+void terrastream::intersect_triangle(triangle *t,elev_t gran,float z_diff,
+									 segment_buffer &out,bool snap) {
+	intersect_all(t,gran,z_diff,out,snap);
+}
+
 map_info terrastream::intersect(stream<triangle> &in,elev_t gran,float z_diff,
-								stream<signed_contour_segment> &out) {
+								stream<signed_contour_segment> &out,bool snap) {
 	cerr << "Intersect: " << gran << "," << z_diff << endl;
 	if (in.stream_len()==0) return map_info();
 	in.seek(0);
@@ -102,36 +218,12 @@ map_info terrastream::intersect(stream<triangle> &in,elev_t gran,float z_diff,
 	map_info res;
 	triangle* t;
 	in.read_item(&t);
-	res.minX=res.maxX=t->points[0].x;
-	res.minY=res.maxY=t->points[0].y;
-	res.minZ=res.maxZ=t->points[0].z;
+	init_map_info(res,t);
 	tflow_progress progress("Intersecting triangles", "Intersecting triangles", 0, in.stream_len(), 1);
 	do{
 		update_map_info(res,t);
 		//Start intersecting
-		elev_t zs[3];
-		for (int i=0;i<3;i++) zs[i]=t->points[i].z;
-		elev_t minz = min(min(zs[0],zs[1]),zs[2]);
-		elev_t maxz = max(max(zs[0],zs[1]),zs[2]);
-		if (minz==maxz) continue; //Flat triangles gives no contours
-		elev_t pz;
-		int hs = int(ceil(minz/gran))-2;
-		while ((pz=++hs*gran)<=maxz+gran) {
-			if (z_diff > 0 && 2*z_diff <= gran) {
-				if(2*z_diff < gran) {
-					for (int i=-1;i<2;i++) {
-						intersect_once(pz+i*z_diff,minz,maxz,t,zs,out);
-					}
-				}
-				else {
-					intersect_once(pz,minz,maxz,t,zs,out);
-					intersect_once(pz-z_diff,minz,maxz,t,zs,out);
-				}
-			} 
-			else {
-				intersect_once(pz,minz,maxz,t,zs,out);
-			}
-		}
+		intersect_triangle(t,gran,z_diff,out,snap);
 		progress.step();
 	}while(in.read_item(&t)==ami::NO_ERROR);
 	progress.done();
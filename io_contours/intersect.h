@@ -9,9 +9,13 @@
 #include "contour_types.h"
 #include <terrastream/common/tflow_types.h>
 #include <terrastream/common/wlabel.h>
+#include <vector>
 
 namespace terrastream{
 
+  //In-memory buffer of segments filled by a worker thread (see worker_threads.h).
+  typedef std::vector<signed_contour_segment> segment_buffer;
+
   //Takes the input stream of triangles and creates the contour segments resulting from intersecting
   //the triangles with the contour planes with displacement equal to the granularity.
   //Each segment is marked with a sign, which indicates whether
@@ -21,7 +25,27 @@ namespace terrastream{
 
   //Does the same as the other intersect, but for every level t, edges for contours on levels
   //t-z_diff and t+z_diff are added.
+  //If snap is set, the points interpolated on the edges of the triangles are moved to the nearest
+  //point of the lattice of packed_contours.h, and segments left with a single point are dropped.
+  //The vertices of the triangles are expected to be on the lattice already.
   map_info intersect(stream<triangle> &input,elev_t granularity,float z_diff,
-			 stream<signed_contour_segment> &output);
+			 stream<signed_contour_segment> &output,bool snap = false);
+
+  //Intersects a single triangle with all contour planes (and their z_diff offsets, as above) and
+  //writes the resulting segments to output. This is the per-triangle step of intersect, exposed
+  //for producers that generate triangles on the fly rather than through a stream.
+  void intersect_triangle(triangle *t,elev_t granularity,float z_diff,
+			 stream<signed_contour_segment> &output,bool snap = false);
+
+  //Same as above, but appends the segments to an in-memory buffer. Unlike streams, these can be
+  //filled from several threads at once (one buffer per thread).
+  void intersect_triangle(triangle *t,elev_t granularity,float z_diff,
+			 segment_buffer &output,bool snap = false);
+
+  //Initializes m to the bounding box of the triangle t.
+  void init_map_info(map_info &m,triangle *t);
+
+  //Extends m to contain the triangle t.
+  void update_map_info(map_info &m,triangle *t);
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_INTERSECT_H__*/
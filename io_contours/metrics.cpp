@@ -0,0 +1,93 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "metrics.h"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+using namespace terrastream;
+
+static const char *PHASE_NAMES[metrics::PHASES] = {
+	"extract", "contours", "order_sort", "simplify", "family_load", "family_write",
+	"family", "decomposition", "contour", "crossings"
+};
+
+bool metrics::on = false;
+
+void metrics::enable(bool e) {
+	on = e;
+}
+
+metrics::recorder& metrics::global() {
+	static recorder r;
+	return r;
+}
+
+metrics::recorder::recorder() {
+	memset(phases, 0, sizeof(phases));
+}
+
+void metrics::recorder::add(phase p, long long us) {
+	phase_stats &s = phases[p];
+	s.count++;
+	s.total_us += us;
+	s.max_us = std::max(s.max_us, us);
+	int b = 0;
+	while(b < BUCKETS-1 && us >> b)
+		b++;
+	s.buckets[b]++;
+}
+
+void metrics::recorder::add(const recorder &r) {
+	for(int p = 0; p < PHASES; p++) {
+		phase_stats &s = phases[p];
+		const phase_stats &o = r.phases[p];
+		s.count += o.count;
+		s.total_us += o.total_us;
+		s.max_us = std::max(s.max_us, o.max_us);
+		for(int b = 0; b < BUCKETS; b++)
+			s.buckets[b] += o.buckets[b];
+	}
+	for(std::map<std::string,long long>::const_iterator it = r.counters.begin(); it != r.counters.end(); ++it)
+		counters[it->first] += it->second;
+}
+
+void metrics::recorder::count(const std::string &name, long long n) {
+	counters[name] += n;
+}
+
+void metrics::recorder::write_json(std::ostream &out) const {
+	out << "{" << std::endl << "  \"phases\": {";
+	bool first = true;
+	for(int p = 0; p < PHASES; p++) {
+		const phase_stats &s = phases[p];
+		if(s.count == 0)
+			continue;
+		out << (first ? "" : ",") << std::endl;
+		first = false;
+		out << "    \"" << PHASE_NAMES[p] << "\": {\"count\": " << s.count << ", \"total_us\": " << s.total_us
+			<< ", \"max_us\": " << s.max_us << ", \"histogram_log2_us\": [";
+		int last = BUCKETS-1;
+		while(last > 0 && s.buckets[last] == 0)
+			last--;
+		for(int b = 0; b <= last; b++)
+			out << (b == 0 ? "" : ", ") << s.buckets[b];
+		out << "]}";
+	}
+	out << std::endl << "  }," << std::endl << "  \"counters\": {";
+	first = true;
+	for(std::map<std::string,long long>::const_iterator it = counters.begin(); it != counters.end(); ++it) {
+		out << (first ? "" : ",") << std::endl << "    \"" << it->first << "\": " << it->second;
+		first = false;
+	}
+	out << std::endl << "  }" << std::endl << "}" << std::endl;
+}
+
+bool metrics::write_report(const std::string &path) {
+	std::ofstream out(path.c_str());
+	if(!out)
+		return false;
+	global().write_json(out);
+	return out.good();
+}
@@ -0,0 +1,87 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_METRICS_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_METRICS_H__
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <ostream>
+#include <string>
+#include <map>
+
+namespace terrastream {
+namespace metrics {
+
+/*
+ * Timers and counters of the phases of extraction and simplification. Nothing is recorded
+ * unless enabled, in which case a timer costs two clock reads. Phases may nest, e.g.
+ * ORDER_SORT is part of CONTOURS.
+ */
+enum phase {
+	EXTRACT,       // Triangulating and intersecting the grid.
+	CONTOURS,      // Contours and topology from the intersections.
+	ORDER_SORT,    // Sorts in order_for_simplification.
+	SIMPLIFY,      // constrained_dp in total.
+	FAMILY_LOAD,   // Reading a family from the queues and streams.
+	FAMILY_WRITE,  // Writing a family to the output and the queues.
+	FAMILY,        // Simplifying the siblings of a family.
+	DECOMPOSITION, // Building and updating the decompositions of a family.
+	CONTOUR,       // Douglas Peucker or Visvalingam-Whyatt of a single contour.
+	CROSSINGS,     // Finding and fixing self intersections of a single contour.
+	PHASES
+};
+
+// Bucket 0 counts durations below 1 microsecond and bucket i>0 those in [2^(i-1);2^i[ microseconds.
+static const int BUCKETS = 32;
+
+struct phase_stats {
+	long long count, total_us, max_us;
+	long long buckets[BUCKETS];
+};
+
+/*
+ * Durations of phases and named counters. Every thread records in its own recorder, and
+ * recorders are added on the thread that owns global().
+ */
+class recorder {
+public:
+	recorder();
+	void add(phase p, long long us);
+	void add(const recorder &r);
+	void count(const std::string &name, long long n);
+	void write_json(std::ostream &out) const;
+
+	phase_stats phases[PHASES];
+	std::map<std::string,long long> counters;
+};
+
+extern bool on; // Use enabled().
+inline bool enabled() { return on; }
+void enable(bool e);
+
+// The recorder of the main thread.
+recorder& global();
+
+// Writes global() as JSON. Returns false if path cannot be written.
+bool write_report(const std::string &path);
+
+// Records the duration of its scope as p in rec.
+class timer {
+public:
+	timer(phase ph, recorder &r = global()) : p(ph), rec(r), started(on) {
+		if(started)
+			start = boost::posix_time::microsec_clock::universal_time();
+	}
+	~timer() {
+		if(started)
+			rec.add(p, (boost::posix_time::microsec_clock::universal_time()-start).total_microseconds());
+	}
+private:
+	phase p;
+	recorder &rec;
+	bool started;
+	boost::posix_time::ptime start;
+};
+
+}
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_METRICS_H__*/
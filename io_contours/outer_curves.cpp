@@ -14,25 +14,22 @@ xycoord_t foo_sign(triangle_point p1,triangle_point p2,triangle_point p3) {
 	return (p1.x-p3.x)*(p2.y-p3.y)-(p2.x-p3.x)*(p1.y-p3.y);
 }
 
-struct endpoint_segment{
-	triangle_point p1,p2;
-	endpoint_segment() {}
-	endpoint_segment(triangle_point _p1,triangle_point _p2) {
-		if (_p2.x<_p1.x || _p2.x==_p1.x && _p2.y<_p1.y) {
-			swap(_p1,_p2);
-		}
-		p1=_p1; p2=_p2;
-	}
-	bool operator<(const endpoint_segment &s) const{
-		if (p1.x!=s.p1.x) return p1.x<s.p1.x;
-		if (p1.y!=s.p1.y) return p1.y<s.p1.y;
-		if (p2.x==s.p2.x && p2.y==s.p2.y) return 0;
-		//return 0;
-		xycoord_t sgn = foo_sign(p1,p2,s.p2); //(p1.x-s.p2.x)*(p2.y-s.p2.y)-(p2.x-s.p2.x)*(p1.y-s.p2.y);
-		//cout << "sign is " << sign << "\n";
-		return sgn<0;
+endpoint_segment::endpoint_segment(triangle_point _p1,triangle_point _p2) {
+	if (_p2.x<_p1.x || _p2.x==_p1.x && _p2.y<_p1.y) {
+		swap(_p1,_p2);
 	}
-};
+	p1=_p1; p2=_p2;
+}
+
+bool endpoint_segment::operator<(const endpoint_segment &s) const{
+	if (p1.x!=s.p1.x) return p1.x<s.p1.x;
+	if (p1.y!=s.p1.y) return p1.y<s.p1.y;
+	if (p2.x==s.p2.x && p2.y==s.p2.y) return 0;
+	//return 0;
+	xycoord_t sgn = foo_sign(p1,p2,s.p2); //(p1.x-s.p2.x)*(p2.y-s.p2.y)-(p2.x-s.p2.x)*(p1.y-s.p2.y);
+	//cout << "sign is " << sign << "\n";
+	return sgn<0;
+}
 
 struct cmp_segments{
 	inline int compare(const endpoint_segment &i1, const endpoint_segment &i2) {
@@ -139,6 +136,11 @@ void terrastream::add_outer_curves(stream<triangle> &tris,elev_t gran,map_info &
 		}
 	}
 	create_progress.done();
+	add_outer_curves(edges,gran,info,out);
+}
+
+void terrastream::add_outer_curves(stream<endpoint_segment> &edges,elev_t gran,map_info &info,stream<labelling_signed_contour_segment> &out) {
+	if (edges.stream_len()==0) return;
 	//Sort the edges by left endpoint
 	tflow_progress sort_progress("Sorting segments", "Sorting segments", 0, edges.stream_len(), 1);
 	cmp_segments cmp;
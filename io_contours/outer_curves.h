@@ -11,10 +11,23 @@
 
 namespace terrastream{
 
+	//An edge of the triangulation with endpoints sorted such that p1 is left of (or below) p2.
+	struct endpoint_segment{
+		triangle_point p1,p2;
+		endpoint_segment() {}
+		endpoint_segment(triangle_point _p1,triangle_point _p2);
+		bool operator<(const endpoint_segment &s) const;
+	};
+
 	//This routine adds curves outside the convex triangulation.
 	//Each segment in the output has their sign set to true.
 	//The map_info object can be obtained by the intersect routine in intersect.h
 	void add_outer_curves(stream<triangle> &tris,elev_t granularity,map_info &info,stream<labelling_signed_contour_segment> &output);
 
+	//Same as above, but with the edges of the triangulation given directly instead of the triangles.
+	//Only the boundary edges of the triangulation are used, so it suffices for edges to contain those,
+	//each exactly once. Interior edges, if present, must occur twice.
+	void add_outer_curves(stream<endpoint_segment> &edges,elev_t granularity,map_info &info,stream<labelling_signed_contour_segment> &output);
+
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_OUTER_CURVES_H__*/
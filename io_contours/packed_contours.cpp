@@ -0,0 +1,138 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "packed_contours.h"
+#include <math.h>
+#include <string.h>
+#include <limits.h>
+#include <cassert>
+
+using namespace terrastream;
+
+// Records with these as a are not differences:
+static const int LABEL = INT_MIN;   // b is the label of the points that follow.
+static const int RANK = INT_MIN+1;  // b is the rank of the next point.
+static const int ABS = INT_MIN+2;   // The next two records are the lattice coordinates of a point.
+static const int RAW = INT_MIN+3;   // The next two records are the coordinates of a point.
+static const long long MAX_DIFF = 1 << 30;
+
+static const double SCALE = ldexp(1.0, LATTICE_BITS);
+static const double MAX_LATTICE = ldexp(1.0, 62);
+
+xycoord_t terrastream::snap_to_lattice(xycoord_t v) {
+	double q = floor(v * SCALE + 0.5);
+	if(fabs(q) >= MAX_LATTICE)
+		return v;
+	return (xycoord_t)(q / SCALE);
+}
+
+// True if v is on the lattice, with q its lattice coordinate.
+static bool lattice(xycoord_t v, long long &q) {
+	double s = v * SCALE;
+	if(s != floor(s) || fabs(s) >= MAX_LATTICE)
+		return false;
+	q = (long long)s;
+	return true;
+}
+
+static packed_record split(long long v) {
+	return packed_record((int)(v >> 32), (int)(unsigned int)(v & 0xFFFFFFFFLL));
+}
+
+static long long join(const packed_record &r) {
+	return ((long long)r.a << 32) | (unsigned int)r.b;
+}
+
+static packed_record raw(xycoord_t v) {
+	double d = v;
+	long long l;
+	memcpy(&l, &d, sizeof(l));
+	return split(l);
+}
+
+static xycoord_t unraw(long long l) {
+	double d;
+	memcpy(&d, &l, sizeof(d));
+	return (xycoord_t)d;
+}
+
+packed_encoder::packed_encoder() : label(INT_MIN), rank(0), on_lattice(false), qx(0), qy(0) {}
+
+packed_encoder::packed_encoder(int l) : label(l), rank(0), on_lattice(false), qx(0), qy(0) {}
+
+int packed_encoder::encode(const contour_point &p, packed_record *out) {
+	int n = 0;
+	if(p.label != label) {
+		out[n++] = packed_record(LABEL, p.label);
+		label = p.label;
+		rank = 0;
+		on_lattice = false;
+	}
+	if(p.rank != rank)
+		out[n++] = packed_record(RANK, p.rank);
+	rank = p.rank+1;
+
+	long long x, y;
+	bool l = lattice(p.x, x) && lattice(p.y, y);
+	if(!l) {
+		out[n++] = packed_record(RAW, 0);
+		out[n++] = raw(p.x);
+		out[n++] = raw(p.y);
+	}
+	else if(on_lattice && x-qx < MAX_DIFF && qx-x < MAX_DIFF && y-qy < MAX_DIFF && qy-y < MAX_DIFF) {
+		out[n++] = packed_record((int)(x-qx), (int)(y-qy));
+	}
+	else {
+		out[n++] = packed_record(ABS, 0);
+		out[n++] = split(x);
+		out[n++] = split(y);
+	}
+	on_lattice = l;
+	if(l) {
+		qx = x;
+		qy = y;
+	}
+	assert(n <= MAX_RECORDS);
+	return n;
+}
+
+packed_decoder::packed_decoder() : label(INT_MIN), rank(0), qx(0), qy(0), pending(0), raw(false), first(0) {}
+
+packed_decoder::packed_decoder(int l) : label(l), rank(0), qx(0), qy(0), pending(0), raw(false), first(0) {}
+
+bool packed_decoder::decode(const packed_record &r, contour_point &p) {
+	if(pending == 2) {
+		first = join(r);
+		pending = 1;
+		return false;
+	}
+	if(pending == 1) {
+		pending = 0;
+		if(raw) {
+			p = contour_point(unraw(first), unraw(join(r)), rank++, label);
+			return true;
+		}
+		qx = first;
+		qy = join(r);
+	}
+	else if(r.a == LABEL) {
+		label = r.b;
+		rank = 0;
+		return false;
+	}
+	else if(r.a == RANK) {
+		rank = r.b;
+		return false;
+	}
+	else if(r.a == ABS || r.a == RAW) {
+		raw = (r.a == RAW);
+		pending = 2;
+		return false;
+	}
+	else {
+		qx += r.a;
+		qy += r.b;
+	}
+	p = contour_point((xycoord_t)(qx / SCALE), (xycoord_t)(qy / SCALE), rank++, label);
+	return true;
+}
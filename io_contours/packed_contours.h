@@ -0,0 +1,62 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_PACKED_CONTOURS_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_PACKED_CONTOURS_H__
+#include <terrastream/common/common.h>
+#include <tpie/stream.h>
+#include "contour_types.h"
+
+namespace terrastream{
+
+/*
+ * Compact encoding of a sequence of contour points in 8 byte records. The label is written
+ * when it changes and the rank when it is not one more than the rank before. Points on the
+ * lattice of LATTICE_BITS fractional bits are written as the difference to the point before
+ * in one record. Other points are written as they are, so the encoding is always lossless,
+ * and a contour on the lattice takes a third of the space of its contour_points.
+ * Extraction with snap puts the points it interpolates on the lattice (see intersect.h).
+ */
+struct packed_record {
+	int a, b;
+	packed_record() {}
+	packed_record(int _a, int _b) : a(_a), b(_b) {}
+};
+
+static const int LATTICE_BITS = 20;
+
+// The lattice point nearest to v.
+xycoord_t snap_to_lattice(xycoord_t v);
+
+class packed_encoder {
+public:
+	static const int MAX_RECORDS = 5; // Per point.
+
+	packed_encoder();
+	// For points of one contour: The label is not written for points labelled label.
+	explicit packed_encoder(int label);
+	// Writes the records of p to out and returns their number.
+	int encode(const contour_point &p, packed_record *out);
+private:
+	int label, rank;
+	bool on_lattice; // The last point is at (qx,qy) on the lattice.
+	long long qx, qy;
+};
+
+class packed_decoder {
+public:
+	packed_decoder();
+	// For the points of one contour, as written by packed_encoder(label).
+	explicit packed_decoder(int label);
+	// Reads the next record. Returns true when it completes a point, which is then in p.
+	bool decode(const packed_record &r, contour_point &p);
+private:
+	int label, rank;
+	long long qx, qy;
+	int pending; // Records left of an absolute or raw point.
+	bool raw;
+	long long first; // Of the two records of an absolute or raw point.
+};
+
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_PACKED_CONTOURS_H__*/
@@ -0,0 +1,108 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "point_index.h"
+#include <boost/functional/hash.hpp>
+#include <cassert>
+
+using namespace std;
+using namespace terrastream;
+
+static const size_t INITIAL_SLOTS = 64;
+
+point_index::point_index() : gen(1), mask(INITIAL_SLOTS-1) {
+	slot empty = {0, NONE};
+	slots.resize(INITIAL_SLOTS, empty);
+}
+
+void point_index::clear() {
+	pts.clear();
+	edges.clear();
+	++gen;
+	if (gen == 0) {
+		// Generations wrapped around. Reset all slots.
+		slot empty = {0, NONE};
+		fill(slots.begin(), slots.end(), empty);
+		gen = 1;
+	}
+}
+
+inline size_t point_index::hash(xycoord_t x, xycoord_t y) const {
+	// boost::hash_value maps 0 and -0 to the same value as required for == on coordinates.
+	size_t h = boost::hash_value(x);
+	boost::hash_combine(h, y);
+	return h;
+}
+
+point_index::index_t point_index::find(xycoord_t x, xycoord_t y) const {
+	for (size_t s = hash(x,y) & mask; slots[s].gen == gen; s = (s+1) & mask) {
+		const segment_point &p = pts[slots[s].idx];
+		if (p.x == x && p.y == y)
+			return slots[s].idx;
+	}
+	return NONE;
+}
+
+point_index::index_t point_index::insert(xycoord_t x, xycoord_t y) {
+	if (2*(pts.size()+1) > slots.size())
+		grow();
+	size_t s = hash(x,y) & mask;
+	for (; slots[s].gen == gen; s = (s+1) & mask) {
+		const segment_point &p = pts[slots[s].idx];
+		if (p.x == x && p.y == y)
+			return slots[s].idx;
+	}
+	slots[s].gen = gen;
+	slots[s].idx = (index_t)pts.size();
+	pts.push_back(segment_point(x,y));
+	return slots[s].idx;
+}
+
+// Doubles the table and reinserts the points of the current generation.
+void point_index::grow() {
+	slot empty = {0, NONE};
+	slots.assign(2*slots.size(), empty);
+	mask = slots.size()-1;
+	gen = 1;
+	for (index_t i = 0; i < pts.size(); i++) {
+		size_t s = hash(pts[i].x,pts[i].y) & mask;
+		while (slots[s].gen == gen)
+			s = (s+1) & mask;
+		slots[s].gen = gen;
+		slots[s].idx = i;
+	}
+}
+
+void point_index::add_edge(index_t a, index_t b, index_t seg) {
+	edge e = {a, b, seg};
+	edges.push_back(e);
+}
+
+void point_index::build_adjacency() {
+	index_t n = size();
+	offset.assign(n+1, 0);
+	for (size_t i = 0; i < edges.size(); i++) {
+		offset[edges[i].a+1]++;
+		offset[edges[i].b+1]++;
+	}
+	for (index_t i = 0; i < n; i++)
+		offset[i+1] += offset[i];
+	adj.resize(offset[n]);
+	deg.assign(n, 0);
+	for (size_t i = 0; i < edges.size(); i++) {
+		const edge &e = edges[i];
+		adj[offset[e.a] + deg[e.a]++] = neighbour(e.b, e.seg);
+		adj[offset[e.b] + deg[e.b]++] = neighbour(e.a, e.seg);
+	}
+}
+
+void point_index::erase_neighbours(index_t i, index_t j1, index_t j2) {
+	assert(j1 != j2 && j1 < deg[i] && j2 < deg[i]);
+	neighbour *ns = neighbours(i);
+	index_t k = 0;
+	for (index_t j = 0; j < deg[i]; j++) {
+		if (j != j1 && j != j2)
+			ns[k++] = ns[j];
+	}
+	deg[i] = k;
+}
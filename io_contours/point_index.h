@@ -0,0 +1,68 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_POINT_INDEX_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_POINT_INDEX_H__
+#include <terrastream/common/common.h>
+#include "contour_types.h"
+#include <vector>
+#include <utility>
+
+namespace terrastream{
+
+/*
+ * Graph of the end points of the segments of a contour. Points are numbered in order of first
+ * insertion through an open addressing hash table, and the neighbours of every point are kept in
+ * one contiguous array in the order the edges were added.
+ * Meant to be reused for contour after contour: clear() keeps all memory.
+ */
+class point_index {
+public:
+	typedef unsigned int index_t; // kept as 32-bit like CW_SIZE_T
+	typedef std::pair<index_t,index_t> neighbour; // adjacent point, seg index in contour
+	static const index_t NONE = 0xFFFFFFFFu;
+
+	point_index();
+
+	// Removes all points and edges.
+	void clear();
+	// Returns the index of the point, adding it if it is new.
+	index_t insert(xycoord_t x, xycoord_t y);
+	// Returns the index of the point or NONE.
+	index_t find(xycoord_t x, xycoord_t y) const;
+	index_t size() const { return (index_t)pts.size(); }
+	const segment_point &point(index_t i) const { return pts[i]; }
+
+	// Adds seg between the points a and b. Call build_adjacency() when all edges are added.
+	void add_edge(index_t a, index_t b, index_t seg);
+	void build_adjacency();
+
+	index_t degree(index_t i) const { return deg[i]; }
+	neighbour *neighbours(index_t i) { return &adj[offset[i]]; }
+	// Removes the neighbours at positions j1 and j2 of the point i keeping the order of the rest.
+	void erase_neighbours(index_t i, index_t j1, index_t j2);
+
+private:
+	struct slot {
+		unsigned int gen; // slot is in use if gen equals the current generation
+		index_t idx;
+	};
+	struct edge {
+		index_t a, b, seg;
+	};
+
+	size_t hash(xycoord_t x, xycoord_t y) const;
+	void grow();
+
+	unsigned int gen;
+	size_t mask;
+	std::vector<slot> slots;
+	std::vector<segment_point> pts;
+	std::vector<edge> edges;
+	std::vector<index_t> offset;
+	std::vector<index_t> deg;
+	std::vector<neighbour> adj;
+};
+
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_POINT_INDEX_H__*/
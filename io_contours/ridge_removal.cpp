@@ -3,6 +3,10 @@
 
 #include "ridge_removal.h"
 #include <terrastream/common/sort.h>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <deque>
+#include <cmath>
 
 using namespace std;
 using namespace tpie;
@@ -64,3 +68,101 @@ void terrastream::remove_ridges_and_duplets(stream<signed_contour_segment> &in,s
 	}
 	progress.done();
 }
+
+struct segment_key{
+	xycoord_t x1,y1,x2,y2;
+	segment_key(const signed_contour_segment &s) : x1(s.x1), y1(s.y1), x2(s.x2), y2(s.y2) {}
+	bool operator==(const segment_key &o) const {
+		return x1==o.x1 && y1==o.y1 && x2==o.x2 && y2==o.y2;
+	}
+	xycoord_t min_y() const { return y1<y2 ? y1 : y2; }
+};
+
+struct segment_key_hash{
+	size_t operator()(const segment_key &k) const {
+		size_t h=0;
+		boost::hash_combine(h,k.x1);
+		boost::hash_combine(h,k.y1);
+		boost::hash_combine(h,k.x2);
+		boost::hash_combine(h,k.y2);
+		return h;
+	}
+};
+
+//A segment in the window together with what is known about its duplicates so far
+struct window_entry{
+	signed_contour_segment s;
+	bool alone;
+	bool ridge;
+	window_entry(const signed_contour_segment &_s) : s(_s), alone(true), ridge(false) {}
+};
+
+typedef boost::unordered_map<segment_key,window_entry,segment_key_hash> segment_window;
+
+//A segment can only lie on a triangle edge of the grid if both end points are grid points
+static inline bool on_grid_points(const signed_contour_segment &s) {
+	return floor(s.x1)==s.x1 && floor(s.y1)==s.y1 && floor(s.x2)==s.x2 && floor(s.y2)==s.y2;
+}
+
+//Same rules as in remove_ridges_and_duplets
+static inline void retire(const window_entry &e,stream<labelling_signed_contour_segment> &out) {
+	if (e.ridge) return;
+	if (e.alone && e.s.sign) return;
+	labelling_signed_contour_segment o(e.s.x1,e.s.y1,e.s.x2,e.s.y2,e.s.z);
+	out.write_item(o);
+}
+
+void terrastream::remove_ridges_and_duplets_in_rows(stream<signed_contour_segment> &in,stream<labelling_signed_contour_segment> &out) {
+	if (in.stream_len()==0) return;
+	in.seek(0);
+	segment_window window;
+	//Keys of the window in order of insertion, which is also roughly the order in which they can be retired
+	deque<segment_key> pending;
+	signed_contour_segment *t;
+	//Lower bound on the row pair currently being read. A segment of row pair r lies within [r,r+1] in y.
+	xycoord_t row=0;
+	bool first=true;
+	tflow_progress progress("Removing ridges", "Removing ridges", 0, in.stream_len(), 1);
+	while (in.read_item(&t)==ami::NO_ERROR) {
+		progress.step();
+		xycoord_t r=ceil(t->y1>t->y2 ? t->y1 : t->y2)-1;
+		if (first || r>row) {
+			row=r;
+			first=false;
+			//A segment below the current row pair will not get any more duplicates
+			while (!pending.empty() && pending.front().min_y()<row) {
+				segment_window::iterator it=window.find(pending.front());
+				assert(it!=window.end());
+				retire(it->second,out);
+				window.erase(it);
+				pending.pop_front();
+			}
+		}
+		if (!on_grid_points(*t)) {
+			//Lies inside a triangle and cannot be duplicated
+			retire(window_entry(*t),out);
+			continue;
+		}
+		segment_key k(*t);
+		pair<segment_window::iterator,bool> ins=window.insert(make_pair(k,window_entry(*t)));
+		if (ins.second) {
+			pending.push_back(k);
+			continue;
+		}
+		//The segment t is a duplicate
+		window_entry &e=ins.first->second;
+		e.alone=false;
+		if (t->sign==e.s.sign) {
+			//This is a ridge
+			e.ridge=true;
+		}
+	}
+	while (!pending.empty()) {
+		segment_window::iterator it=window.find(pending.front());
+		assert(it!=window.end());
+		retire(it->second,out);
+		window.erase(it);
+		pending.pop_front();
+	}
+	progress.done();
+}
@@ -17,5 +17,12 @@ namespace terrastream{
 	//The segments are outputted with the sign set to false.
 	void remove_ridges_and_duplets(stream<signed_contour_segment> &input,stream<labelling_signed_contour_segment> &output);
 
+	//As remove_ridges_and_duplets, but without sorting the input. This requires the segments to come from
+	//the triangulation of a grid with unit spacing (as made by read_grid), in order of non-decreasing row,
+	//so that two segments on the same triangle edge are never more than one row apart. Only segments
+	//between two grid points can lie on an edge; these are matched in a small window of rows while all
+	//other segments are written directly. The order of the output differs from remove_ridges_and_duplets.
+	void remove_ridges_and_duplets_in_rows(stream<signed_contour_segment> &input,stream<labelling_signed_contour_segment> &output);
+
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_RIDGE_REMOVAL_H__*/
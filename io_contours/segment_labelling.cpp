@@ -0,0 +1,101 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "segment_labelling.h"
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <vector>
+#include <limits>
+
+using namespace std;
+using namespace tpie;
+using namespace terrastream;
+
+typedef labelling_signed_contour_segment lbls;
+typedef labelled_signed_contour_segment lss;
+typedef unsigned int UF_SIZE_T; // kept as 32-bit like CW_SIZE_T in cw_ordering
+
+size_t terrastream::in_memory_labelling_budget = IN_MEMORY_LABELLING_BUDGET;
+
+struct segment_point_hash{
+	size_t operator()(const segment_point &p) const {
+		size_t h=0;
+		boost::hash_combine(h,p.x);
+		boost::hash_combine(h,p.y);
+		return h;
+	}
+};
+
+typedef boost::unordered_map<segment_point,UF_SIZE_T,segment_point_hash> endpoint_map;
+
+// Estimate per segment: the segment, its parent and label, and about one hash entry
+// (node, bucket and allocation overhead) per end point since most points are shared by two segments.
+static const size_t BYTES_PER_SEGMENT = sizeof(lbls) + 2*sizeof(UF_SIZE_T) + sizeof(int) +
+	(sizeof(segment_point) + sizeof(UF_SIZE_T) + 4*sizeof(void*));
+
+bool terrastream::fits_in_memory_labelling(stream<lbls> &segs) {
+	size_t n = segs.stream_len();
+	if (n >= std::numeric_limits<UF_SIZE_T>::max())
+		return false;
+	return n <= in_memory_labelling_budget / BYTES_PER_SEGMENT;
+}
+
+static inline UF_SIZE_T find_root(vector<UF_SIZE_T> &parent, UF_SIZE_T i) {
+	while (parent[i]!=i) {
+		parent[i]=parent[parent[i]]; // path halving
+		i=parent[i];
+	}
+	return i;
+}
+
+// Links the two components. The smaller root survives, so the labels do not depend on hashing.
+static inline void join(vector<UF_SIZE_T> &parent, UF_SIZE_T a, UF_SIZE_T b) {
+	a=find_root(parent,a);
+	b=find_root(parent,b);
+	if (a==b) return;
+	if (a<b)
+		parent[b]=a;
+	else
+		parent[a]=b;
+}
+
+void terrastream::label_segments_in_memory(stream<lbls> &in, stream<lss> &out) {
+	if (in.stream_len()==0) return;
+	in.seek(0);
+	UF_SIZE_T n = (UF_SIZE_T)in.stream_len();
+	vector<lbls> segs;
+	segs.reserve(n);
+	vector<UF_SIZE_T> parent;
+	parent.reserve(n);
+	endpoint_map first_seg;
+	first_seg.rehash(n);
+
+	tflow_progress progress("Labelling segments", "Labelling segments", 0, in.stream_len(), 1);
+	lbls *s;
+	while (in.read_item(&s)==ami::NO_ERROR) {
+		progress.step();
+		UF_SIZE_T i = (UF_SIZE_T)segs.size();
+		segs.push_back(*s);
+		parent.push_back(i);
+		for (int j=0;j<2;j++) {
+			pair<endpoint_map::iterator,bool> ins = first_seg.insert(make_pair(s->p[j],i));
+			if (!ins.second)
+				join(parent,ins.first->second,i);
+		}
+	}
+	progress.done();
+	first_seg.clear();
+
+	//Number the components in order of their first segment
+	vector<int> label(n,-1);
+	int next_label=0;
+	for (UF_SIZE_T i=0;i<n;i++) {
+		UF_SIZE_T r = find_root(parent,i);
+		if (label[r]<0)
+			label[r]=next_label++;
+		out.write_item(lss(segs[i],label[r]));
+	}
+#ifdef DEBUG_CONTOURS
+	cerr << "In-memory labelling found " << next_label << " components in " << n << " segments" << endl;
+#endif
+}
@@ -0,0 +1,32 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_SEGMENT_LABELLING_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_SEGMENT_LABELLING_H__
+#include <terrastream/common/common.h>
+#include <tpie/portability.h>
+#include <tpie/stream.h>
+#include "contour_types.h"
+
+// Default number of bytes the in-memory labelling may use before compute_contours falls back
+// to the external Labelling.
+#ifndef IN_MEMORY_LABELLING_BUDGET
+#define IN_MEMORY_LABELLING_BUDGET (256*1024*1024)
+#endif
+
+namespace terrastream{
+
+	//Bytes available to label_segments_in_memory. Set to 0 to always use the external Labelling.
+	extern size_t in_memory_labelling_budget;
+
+	//Returns true if the segments of the stream can be labelled within in_memory_labelling_budget.
+	bool fits_in_memory_labelling(stream<labelling_signed_contour_segment> &segs);
+
+	//Labels the segments by connected components, two segments being connected if they share an
+	//end point, using a union-find over a hash map from end point to segment. The output is
+	//equivalent to that of Labelling::label: every segment once with the label of its component.
+	void label_segments_in_memory(stream<labelling_signed_contour_segment> &segs,
+								  stream<labelled_signed_contour_segment> &out);
+
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_SEGMENT_LABELLING_H__*/
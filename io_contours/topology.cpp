@@ -2,6 +2,7 @@
 // vi:set ts=4 sts=4 sw=4 noet :
 
 #include "topology.h"
+#include "metrics.h"
 #include <terrastream/common/sort.h>
 #include <tpie/priority_queue.h>
 #include <tpie/queue.h>
@@ -667,7 +668,7 @@ void print_stream(stream<contour_point> &s) {
 
 void terrastream::order_for_simplification(stream<topo> &topology,
 										   stream<contour_point> &segs, 
-										   stream<contour_point> &segments2) {
+										   contour_record_stream &out) {
 	// Setup:
 	topology.seek(0);
 	segs.seek(0);
@@ -729,7 +730,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	std::cout << "Time forwarding level sort" << std::endl;
 	std::cerr << "Time forwarding level sort" << std::endl;
 	level_orderer lv_orderer;
-	ts_sort(&levels,&lv_orderer);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&levels,&lv_orderer);
+	}
 	levels.seek(0);
 
 #ifdef DEBUG_OFS
@@ -784,7 +788,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 		
         // sort
 		basic_orderer b_orderer;
-		v.sort(b_orderer);
+		{
+			metrics::timer t_sort(metrics::ORDER_SORT);
+			v.sort(b_orderer);
+		}
 		//std::set<pq_entry,level_orderer> v2; // p=p_li, c=self, lv=li, order by li
 		expand_set<pq_entry> v2(4000);
 		pq_entry item;
@@ -797,7 +804,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 			nid_index++;	
 		}
 
-		v2.sort(lv_orderer);
+		{
+			metrics::timer t_sort(metrics::ORDER_SORT);
+			v2.sort(lv_orderer);
+		}
 
 		while(v2.next(item)) {
 #ifdef DEBUG_OFS
@@ -815,7 +825,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	std::cout << "Time forwarding level sort 2" << std::endl;
 	std::cerr << "Time forwarding level sort 2" << std::endl;
 	first_cmp fc;
-	ts_sort(&nids,&fc);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&nids,&fc);
+	}
 	nids.seek(0);
 	std::cout << "DONE: Time forwarding topo tree for BFS labels" << std::endl;
 	std::cerr << "DONE: Time forwarding topo tree for BFS labels" << std::endl;
@@ -834,7 +847,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	std::cout << "Sorting topology on old parents" << std::endl;
 	std::cerr << "Sorting topology on old parents" << std::endl;
 	topo_parent_order topo_parent_orderer;
-	ts_sort(&topology,&topo_parent_orderer);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&topology,&topo_parent_orderer);
+	}
 	topology.seek(0);	
 
 #ifdef DEBUG_OFS
@@ -851,6 +867,7 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	err e_segs = segs.read_item(&s);
 
 	stream<topo> topo2;
+	stream<contour_point> segments2;
 
  	std::cout << "Updating labels" << std::endl;
  	std::cerr << "Updating labels" << std::endl;
@@ -889,14 +906,20 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	// - sort segments:
 	seg_order seg_orderer;
 	std::cerr << "Sorting segments on new labels" << std::endl;
-	ts_sort(&segments2,&seg_orderer);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&segments2,&seg_orderer);
+	}
 	segments2.seek(0);		
 
 	// sort/scan 2: (topo stream)
 	nids.seek(0);
 //	topo_child_order topo_child_orderer;
 	std::cerr << "Sorting topology on old child labels" << std::endl;
-	ts_sort(&topo2,&topo_child_orderer);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&topo2,&topo_child_orderer);
+	}
 	topo2.seek(0);	
 	e_topo = topo2.read_item(&t);
 	std::cerr << "Updating topology child labels" << std::endl;
@@ -910,7 +933,10 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	} // topology done.
 	topology.seek(0);	
 	std::cerr << "Sorting topology for new labels" << std::endl;
-	ts_sort(&topology,&topo_child_orderer);
+	{
+		metrics::timer t_sort(metrics::ORDER_SORT);
+		ts_sort(&topology,&topo_child_orderer);
+	}
 	topology.seek(0);	
 	topo2.truncate(0);
 	nids.truncate(0);
@@ -934,5 +960,12 @@ void terrastream::order_for_simplification(stream<topo> &topology,
 	}//*/
 	topology.seek(0);
 
+	std::cerr << "Packing contours" << std::endl;
+	out.truncate();
+	to_records(topology, segments2, out);
+	out.rewind();
+	topology.seek(0);
+	segments2.truncate(0);
+
 	std::cerr << "DONE" << std::endl;	
 }
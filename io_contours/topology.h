@@ -7,6 +7,7 @@
 #include <tpie/portability.h>
 #include <tpie/stream.h>
 #include "contour_types.h"
+#include "contour_records.h"
 #include <algorithm>
 #include <vector>
 
@@ -29,9 +30,12 @@ void relabel(stream<ranked_labelled_signed_contour_segment> &ls,
 
 void build_topology(stream<ranked_labelled_signed_contour_segment> &ls,stream<topology_edge> &topology);
 
+// Relabels the contours in BFS order of the topology and writes them as contour records, packed 
+// as in packed_contours.h. The points are sorted as contour_points, so the sort takes their full 
+// size, but only the records are kept. topology is relabelled and sorted as the records.
 void order_for_simplification(stream<topology_edge> &topology,
 							  stream<contour_point> &contours_in,
-							  stream<contour_point> &contours_out);
+							  contour_record_stream &contours_out);
 
 struct pq_entry {
 	int p, lv, c;
@@ -0,0 +1,25 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "worker_threads.h"
+#include <tpie/portability.h>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+unsigned int terrastream::worker_threads(unsigned int threads) {
+#ifdef TPIE_THREADSAFE_MEMORY_MANAGEMNT
+	if (threads == 0)
+		threads = max(1u, boost::thread::hardware_concurrency());
+	return threads;
+#else
+	static bool warned = false;
+	if (threads != 1 && !warned) {
+		cerr << "TPIE is built without TPIE_THREADSAFE_MEMORY_MANAGEMNT. Using a single thread." << endl;
+		warned = true;
+	}
+	return 1;
+#endif
+}
@@ -0,0 +1,16 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_WORKER_THREADS_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_WORKER_THREADS_H__
+
+namespace terrastream{
+
+  //The operator new of TPIE updates its memory accounting, and TPIE and the workers allocate
+  //freely while workers run. That is only safe when TPIE locks its accounting, which it does
+  //when built with TPIE_THREADSAFE_MEMORY_MANAGEMNT. Every use of worker threads asks this for
+  //their number: Returns threads (0: one per core), or 1 (no workers) if TPIE does not lock.
+  unsigned int worker_threads(unsigned int threads);
+
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_IO_CONTOURS_WORKER_THREADS_H__*/
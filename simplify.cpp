@@ -12,9 +12,12 @@
 #include "contour_reader.h"
 #include "contour_to_shape.h"
 #include "contour_simplification.h"
+#include "stream_cache.h"
+#include "io_contours/contour_records.h"
+#include "io_contours/metrics.h"
 #include <tpie/persist.h>
 #include <set>
-#include <time.h>
+#include <string>
 
 using namespace tpie;
 using namespace ami;
@@ -27,86 +30,68 @@ typedef contour_point cp;
 namespace terrastream {
 namespace simplification {
 
-// TODO: Include output file.
-void run(grid_reader<height_type> &reader, float contour_interval, float e_z, float e_dp, bool cdp) {
-	time_t sec = time(NULL);
-
-	ifstream ifile("topo.tpie");
-	bool streams_made = (ifile);
-	ifile.close();
-
-	stream<topology_edge> topo_stream("topo.tpie", streams_made ? READ_STREAM : WRITE_STREAM);
-	stream<contour_point> unsimplified_stream("unsimplified.tpie", streams_made ? READ_STREAM : WRITE_STREAM);
-	stream<contour_point> simplified_stream;
+// Writes a small test: A parent, a contour to simplify and its two children.
+void write_test(stream<topology_edge> &topo_stream, stream<contour_point> &unsimplified_stream) {
+	cerr << " Creating test." << endl;
+	// parent:
+	int r = 0;
+	int l = 1;
+	unsimplified_stream.write_item(cp(0,0,r++,l));
+	unsimplified_stream.write_item(cp(0,9,r++,l));
+	unsimplified_stream.write_item(cp(16,9,r++,l));
+	unsimplified_stream.write_item(cp(16,5,r++,l));
+	unsimplified_stream.write_item(cp(16,0,r++,l));
+	unsimplified_stream.write_item(cp(0,0,r++,l));
+	// to simplify:
+	r = 0;
+	l++;
+	unsimplified_stream.write_item(cp(1,1,r++,l));
+	unsimplified_stream.write_item(cp(1,6,r++,l));
+	unsimplified_stream.write_item(cp(3,7,r++,l));
+	unsimplified_stream.write_item(cp(5,8,r++,l));
+	unsimplified_stream.write_item(cp(7,7,r++,l));
+	unsimplified_stream.write_item(cp(9,8,r++,l));
+	unsimplified_stream.write_item(cp(15,8,r++,l));
+	unsimplified_stream.write_item(cp(14,1,r++,l));
+	unsimplified_stream.write_item(cp(8,1,r++,l));
+	unsimplified_stream.write_item(cp(9,4,r++,l));
+	unsimplified_stream.write_item(cp(6,4,r++,l));
+	unsimplified_stream.write_item(cp(7,1,r++,l));
+	unsimplified_stream.write_item(cp(1,1,r++,l));
+	// child 1:
+	r = 0;
+	l++;
+	unsimplified_stream.write_item(cp(2,2,r++,l));
+	unsimplified_stream.write_item(cp(4,5,r++,l));
+	unsimplified_stream.write_item(cp(6,2,r++,l));
+	unsimplified_stream.write_item(cp(2,2,r++,l));
+	// child 2:
+	r = 0;
+	l++;
+	unsimplified_stream.write_item(cp(6,5,r++,l));
+	unsimplified_stream.write_item(cp(8,7,r++,l));
+	unsimplified_stream.write_item(cp(13,7,r++,l));
+	unsimplified_stream.write_item(cp(13,5,r++,l));
+	unsimplified_stream.write_item(cp(13,2,r++,l));
+	unsimplified_stream.write_item(cp(9,2,r++,l));
+	unsimplified_stream.write_item(cp(11,5,r++,l));
+	unsimplified_stream.write_item(cp(6,5,r++,l));
+	// topo:
+	topo_stream.write_item(topology_edge(1, -1, 0.9));
+	topo_stream.write_item(topology_edge(2, 1, 1));
+	topo_stream.write_item(topology_edge(3, 2, 1.1));
+	topo_stream.write_item(topology_edge(4, 2, 1.1));
+	unsimplified_stream.seek(0);
+	topo_stream.seek(0);
+}
 
-	assert(unsimplified_stream.is_valid());
-	assert(topo_stream.is_valid());
-
-	if (!streams_made) { 
-		if(contour_interval == 0) {
-			cerr << " Creating test." << endl;
-			// parent:
-			int r = 0;
-			int l = 1;
-			unsimplified_stream.write_item(cp(0,0,r++,l));
-			unsimplified_stream.write_item(cp(0,9,r++,l));
-			unsimplified_stream.write_item(cp(16,9,r++,l));
-			unsimplified_stream.write_item(cp(16,5,r++,l));
-			unsimplified_stream.write_item(cp(16,0,r++,l));
-			unsimplified_stream.write_item(cp(0,0,r++,l));
-			// to simplify:
-			r = 0;
-			l++;
-			unsimplified_stream.write_item(cp(1,1,r++,l));
-			unsimplified_stream.write_item(cp(1,6,r++,l));
-			unsimplified_stream.write_item(cp(3,7,r++,l));
-			unsimplified_stream.write_item(cp(5,8,r++,l));
-			unsimplified_stream.write_item(cp(7,7,r++,l));
-			unsimplified_stream.write_item(cp(9,8,r++,l));
-			unsimplified_stream.write_item(cp(15,8,r++,l));
-			unsimplified_stream.write_item(cp(14,1,r++,l));
-			unsimplified_stream.write_item(cp(8,1,r++,l));
-			unsimplified_stream.write_item(cp(9,4,r++,l));
-			unsimplified_stream.write_item(cp(6,4,r++,l));
-			unsimplified_stream.write_item(cp(7,1,r++,l));
-			unsimplified_stream.write_item(cp(1,1,r++,l));
-			// child 1:
-			r = 0;
-			l++;
-			unsimplified_stream.write_item(cp(2,2,r++,l));
-			unsimplified_stream.write_item(cp(4,5,r++,l));
-			unsimplified_stream.write_item(cp(6,2,r++,l));
-			unsimplified_stream.write_item(cp(2,2,r++,l));
-			// child 2:
-			r = 0;
-			l++;
-			unsimplified_stream.write_item(cp(6,5,r++,l));
-			unsimplified_stream.write_item(cp(8,7,r++,l));
-			unsimplified_stream.write_item(cp(13,7,r++,l));
-			unsimplified_stream.write_item(cp(13,5,r++,l));
-			unsimplified_stream.write_item(cp(13,2,r++,l));
-			unsimplified_stream.write_item(cp(9,2,r++,l));
-			unsimplified_stream.write_item(cp(11,5,r++,l));
-			unsimplified_stream.write_item(cp(6,5,r++,l));
-			// topo:
-			topo_stream.write_item(topology_edge(1, -1, 0.9));
-			topo_stream.write_item(topology_edge(2, 1, 1));
-			topo_stream.write_item(topology_edge(3, 2, 1.1));
-			topo_stream.write_item(topology_edge(4, 2, 1.1));
-			return;
-		}
-		contour_reader::read_grid(reader,contour_interval,e_z,topo_stream,unsimplified_stream);
-		cerr << " Input streams created. Exiting." << endl;
-		cerr << (time(NULL)-sec) << " seconds" << endl;
-		return;
-	}
-	else {
-		cerr << " Input streams already created" << endl;
-	}
+// Simplifies the extracted contours and writes them to shape files.
+void simplify_contours(contour_record_stream &unsimplified,
+					   float contour_interval, float e_z, float e_dp, bool cdp,
+					   ::simplification::algorithm alg) {
+	contour_record_stream simplified;
 
 	cerr << "------------ Done read ------------ " << endl;
-	cerr << (time(NULL)-sec) << " seconds" << endl;
-	sec = time(NULL);
 
 	if (!cdp) {
 		cerr << "Running normal Douglas Peucker" << endl;
@@ -118,51 +103,93 @@ void run(grid_reader<height_type> &reader, float contour_interval, float e_z, fl
 			contour_interval = 1;
 			e_z = 0.1;
 		}
-		cerr << "Running constrained Douglas Peucker for e=" << e_dp << endl;
+		if(alg == ::simplification::VISVALINGAM_WHYATT)
+			cerr << "Running constrained Visvalingam-Whyatt for e=" << e_dp << endl;
+		else
+			cerr << "Running constrained Douglas Peucker for e=" << e_dp << endl;
 		constrained_dp(e_dp, 
-					   unsimplified_stream, 
-					   topo_stream, 
+					   unsimplified, 
 					   contour_interval, e_z,
-					   simplified_stream);
+					   simplified,
+					   0, alg);
 	}
 
-	shape::to_shape("test", unsimplified_stream, topo_stream, &simplified_stream, contour_interval, e_z);
+	shape::to_shape("test", unsimplified, &simplified, contour_interval, e_z);
 	// transform stream to output:                    
-	topo_stream.seek(0);                    
-	simplified_stream.seek(0);                      
 	stream<ranked_labelled_signed_contour_segment> out_stream;                  
                          
-	contour_point *point, prev;                     
-	topology_edge *edge = NULL;
-	prev.label = -10; // no such label.                    
-	elev_t z = 0;
-	int rank = 0;
-	while(simplified_stream.read_item(&point) == NO_ERROR) {                  
-		if(prev.label == point->label) {                    
-			out_stream.write_item(ranked_labelled_signed_contour_segment(prev.x,prev.y,              
-																		 point->x,point->y,              
-																		 z,false,               
-																		 prev.label,rank++));             
-		}                        
-		else {
-			ami::err er;
-			do {
-				er = topo_stream.read_item(&edge);
-				assert(er == NO_ERROR);
-			} 
-			while(edge->c != point->label);
-			z = edge->c_z;
-			rank = 0;
-		}                        
-		prev = *point;                      
+	contour_header h;
+	vector<contour_point> points;
+	while(simplified.read(h, points) == NO_ERROR) {
+		for(size_t i = 1; i < points.size(); i++) {
+			out_stream.write_item(ranked_labelled_signed_contour_segment(points[i-1].x,points[i-1].y,
+																		 points[i].x,points[i].y,
+																		 h.z,false,
+																		 h.label,(int)i-1));
+		}
 	}                         
-	topo_stream.seek(0);                                        
-	simplified_stream.seek(0);                      
+	simplified.rewind();
 //	terrastream::output_mif(out_stream,topo_stream,"mifout");
 
 	cerr << "------------ Done run ------------ " << endl;
-	cerr << (time(NULL)-sec) << " additional seconds" << endl;
-	sec = time(NULL);
+}
+
+// Extracts the contours, or reads them from the cache, and simplifies them.
+static void extract_and_simplify(grid_reader<height_type> &reader, const string &grid_path,
+								 float contour_interval, float e_z, float e_dp, bool cdp,
+								 ::simplification::algorithm alg, bool snap, const string &cache_dir, elev_t nodata) {
+	if(contour_interval == 0) {
+		stream<topology_edge> topo_stream;
+		stream<contour_point> unsimplified_stream;
+		write_test(topo_stream, unsimplified_stream);
+		contour_record_stream unsimplified;
+		to_records(topo_stream, unsimplified_stream, unsimplified);
+		unsimplified.rewind();
+		simplify_contours(unsimplified, contour_interval, e_z, e_dp, cdp, alg);
+		return;
+	}
+	// The cache is only safe to use when the grid file is known:
+	string source = ::simplification::stream_cache::describe_file(grid_path);
+	if(source.empty()) {
+		cerr << " Could not read " << grid_path << ". Extracted contours are not cached." << endl;
+		contour_record_stream unsimplified;
+		contour_reader::read_grid(reader,contour_interval,e_z,unsimplified,true,0,snap);
+		simplify_contours(unsimplified, contour_interval, e_z, e_dp, cdp, alg);
+		return;
+	}
+
+	::simplification::stream_cache cache(cache_dir);
+	string description = ::simplification::stream_cache::describe(source, reader.get_ncols(), nodata, contour_interval, e_z, snap);
+	string entry;
+	if(cache.lookup(description)) {
+		entry = cache.entry(description);
+		cerr << " Input streams already created in " << entry << endl;
+	}
+	else {
+		string pending = cache.begin(description);
+		{
+			contour_record_stream unsimplified(::simplification::stream_cache::headers_path(pending),
+											   ::simplification::stream_cache::blocks_path(pending), WRITE_STREAM);
+			contour_reader::read_grid(reader,contour_interval,e_z,unsimplified,true,0,snap);
+		}
+		entry = cache.commit();
+		cerr << " Input streams created in " << entry << endl;
+	}
+	contour_record_stream unsimplified(::simplification::stream_cache::headers_path(entry),
+									   ::simplification::stream_cache::blocks_path(entry), READ_STREAM);
+	simplify_contours(unsimplified, contour_interval, e_z, e_dp, cdp, alg);
+}
+
+// TODO: Include output file.
+void run(grid_reader<height_type> &reader, const string &grid_path, elev_t nodata,
+		 float contour_interval, float e_z, float e_dp, bool cdp,
+		 ::simplification::algorithm alg, bool snap, const string &cache_dir,
+		 const string &metrics_report) {
+	if(!metrics_report.empty())
+		metrics::enable(true);
+	extract_and_simplify(reader, grid_path, contour_interval, e_z, e_dp, cdp, alg, snap, cache_dir, nodata);
+	if(!metrics_report.empty() && !metrics::write_report(metrics_report))
+		cerr << "Could not write " << metrics_report << endl;
 }
 
 }
@@ -5,10 +5,30 @@
 #define __TEST_CONTOUR_SIMPLIFICATION_SIMPLIFY_H__
 #include <terrastream/common/common.h>
 #include "io_contours/contour_types.h"
+#include "contour_simplification.h"
+#include "stream_cache.h"
+#include <string>
 
 namespace terrastream {
 namespace simplification {
-void run(grid_reader<elev_t> &reader, float gran, float e_z, float e_dp, bool cdp);
+// reader reads the grid file at grid_path, opened with nodata as the value of missing cells.
+// alg selects the constrained simplification when cdp is set.
+// The contours extracted from the grid are cached in cache_dir by the path, size and
+// modification time of the grid file (see stream_cache::describe_file) and the extraction
+// parameters, nodata included.
+// If the grid file cannot be found, the contours are extracted on every run.
+// The contours are kept as contour records from extraction on (see io_contours/contour_records.h).
+// If snap is set (the default), the points interpolated on the grid are moved to the lattice of
+// io_contours/packed_contours.h (by less than 1e-6) as they are computed, by which the records take
+// a third of the space of contour_points in the cache and during simplification. Without snap,
+// the points are kept exactly as interpolated, which are seldom on the lattice, so they are
+// written raw in three records each and take no less space than contour_points.
+// If metrics_report is not empty, metrics are enabled (see io_contours/metrics.h) and their
+// report is written to it when done.
+void run(grid_reader<elev_t> &reader, const std::string &grid_path, elev_t nodata,
+		 float gran, float e_z, float e_dp, bool cdp,
+		 ::simplification::algorithm alg = ::simplification::DOUGLAS_PEUCKER, bool snap = true,
+		 const std::string &cache_dir = "stream_cache", const std::string &metrics_report = "");
 }
 }
 #endif /*__TEST_CONTOUR_SIMPLIFICATION_SIMPLIFICATION_H__*/
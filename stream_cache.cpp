@@ -0,0 +1,153 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "stream_cache.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace simplification;
+
+// Bumped when the format of the streams changes, so old entries are not used.
+static const int STREAM_CACHE_VERSION = 2;
+
+static const char *MANIFEST = "manifest";
+static const char *HEADERS = "unsimplified.headers.tpie";
+static const char *BLOCKS = "unsimplified.blocks.tpie";
+static const char *PENDING = ".tmp."; // Followed by host and process id.
+
+static string host_name() {
+	char name[256];
+	if(gethostname(name, sizeof(name)) != 0)
+		return "unknown";
+	name[sizeof(name)-1] = 0;
+	return name;
+}
+
+static void remove_entry(const string &entry) {
+	remove((entry + "/" + MANIFEST).c_str());
+	remove(stream_cache::headers_path(entry).c_str());
+	remove(stream_cache::blocks_path(entry).c_str());
+	rmdir(entry.c_str());
+}
+
+stream_cache::stream_cache(const string &d) : dir(d) {
+	mkdir(dir.c_str(), 0777); // Fails if it exists.
+	remove_stale();
+}
+
+// Removes the directories being filled by processes of this host that are gone. Those of 
+// other hosts sharing the cache cannot be checked and are left.
+void stream_cache::remove_stale() const {
+	DIR *d = opendir(dir.c_str());
+	if(d == NULL)
+		return;
+	const string prefix = PENDING + host_name() + ".";
+	vector<string> stale;
+	for(struct dirent *e = readdir(d); e != NULL; e = readdir(d)) {
+		string name = e->d_name;
+		size_t at = name.find(prefix);
+		if(at == string::npos)
+			continue;
+		pid_t pid = atoi(name.c_str() + at + prefix.size());
+		if(pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+			stale.push_back(dir + "/" + name);
+	}
+	closedir(d);
+	for(size_t i = 0; i < stale.size(); ++i) {
+		cerr << "Removing " << stale[i] << " left by a process that is gone" << endl;
+		remove_entry(stale[i]);
+	}
+}
+
+string stream_cache::describe_file(const string &path) {
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0)
+		return "";
+	ostringstream ss;
+	ss << path << " size=" << st.st_size << " mtime=" << st.st_mtime;
+	return ss.str();
+}
+
+string stream_cache::describe(const string &source, int ncols, float nodata, float contour_interval, float e_z, bool snap) {
+	ostringstream ss;
+	ss.precision(9); // Enough for floats to read back equal.
+	ss << "version=" << STREAM_CACHE_VERSION << " source=" << source << " ncols=" << ncols
+	   << " nodata=" << nodata << " contour_interval=" << contour_interval << " e_z=" << e_z << " snap=" << snap;
+	return ss.str();
+}
+
+string stream_cache::key(const string &description) {
+	// 64 bit FNV-1a:
+	unsigned long long h = 14695981039346656037ULL;
+	for(size_t i = 0; i < description.size(); ++i) {
+		h ^= (unsigned char)description[i];
+		h *= 1099511628211ULL;
+	}
+	char s[17];
+	sprintf(s, "%016llx", h);
+	return s;
+}
+
+bool stream_cache::lookup(const string &description) const {
+	// The manifest is checked as keys may collide:
+	ifstream in((entry(description) + "/" + MANIFEST).c_str());
+	string line;
+	return in && getline(in, line) && line == description;
+}
+
+string stream_cache::entry(const string &description) const {
+	return dir + "/" + key(description);
+}
+
+string stream_cache::headers_path(const string &entry) {
+	return entry + "/" + HEADERS;
+}
+
+string stream_cache::blocks_path(const string &entry) {
+	return entry + "/" + BLOCKS;
+}
+
+string stream_cache::begin(const string &description) {
+	assert(pending.empty());
+	ostringstream ss;
+	ss << entry(description) << PENDING << host_name() << "." << getpid();
+	pending = ss.str();
+	pending_description = description;
+	mkdir(pending.c_str(), 0777);
+	return pending;
+}
+
+string stream_cache::commit() {
+	assert(!pending.empty());
+	{
+		ofstream out((pending + "/" + MANIFEST).c_str());
+		out << pending_description << endl;
+	}
+	string res = entry(pending_description);
+	if(rename(pending.c_str(), res.c_str()) != 0) {
+		if(lookup(pending_description)) {
+			// Another job made the entry:
+			remove_entry(pending);
+		}
+		else {
+			cerr << "Cache entry " << res << " is not for " << pending_description << ". Using " << pending << endl;
+			res = pending;
+		}
+	}
+	pending.clear();
+	pending_description.clear();
+	return res;
+}
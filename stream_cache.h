@@ -0,0 +1,62 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_STREAM_CACHE_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_STREAM_CACHE_H__
+#include <string>
+
+namespace simplification {
+
+	/////////////////////////////////////////////////////////
+	///
+	///  Cache of extracted contours. An entry is a directory dir/key holding the contour records
+	///  (see io_contours/contour_records.h) in unsimplified.headers.tpie and unsimplified.blocks.tpie
+	///  and a manifest with the description the key is a hash of.
+	///  Entries are filled in a directory of their own and renamed into place when complete,
+	///  so concurrent jobs never see a partial entry and never overwrite one in use.
+	///  The directories being filled are named after the host and process filling them, and
+	///  those of processes that are gone are removed when the cache is opened.
+	///
+	/////////////////////////////////////////////////////////
+	class stream_cache {
+	public:
+		stream_cache(const std::string &dir);
+
+		///  Description of an input file by its path, size and modification time.
+		///  Returns the empty string if the file cannot be read.
+		static std::string describe_file(const std::string &path);
+
+		///  Description of the extraction of contours from source with the given parameters.
+		///  nodata is the value the grid reader was opened with.
+		static std::string describe(const std::string &source, int ncols, float nodata,
+									float contour_interval, float e_z, bool snap);
+
+		///  Key of a description: A hash of it in hex.
+		static std::string key(const std::string &description);
+
+		///  True if a complete entry exists for the description.
+		bool lookup(const std::string &description) const;
+		///  Directory of the entry of the description.
+		std::string entry(const std::string &description) const;
+
+		///  Streams of the contour records of an entry:
+		static std::string headers_path(const std::string &entry);
+		static std::string blocks_path(const std::string &entry);
+
+		///  Starts a new entry for the description. Returns the directory to write its streams to.
+		std::string begin(const std::string &description);
+
+		///  Publishes the entry begun and returns the directory to read its streams from.
+		///  If another job published the same entry first, the new one is removed, as both
+		///  have the same content. If an entry of another description has the key, the new 
+		///  entry is kept where it is until the process is gone.
+		std::string commit();
+	private:
+		void remove_stale() const;
+
+		std::string dir;
+		std::string pending; // Directory of the entry being filled.
+		std::string pending_description;
+	};
+}
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_STREAM_CACHE_H__*/
@@ -0,0 +1,155 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#include "synthetic_grid.h"
+#include <terrastream/common/nodata.h>
+#include <math.h>
+#include <cassert>
+#include <algorithm>
+
+using namespace std;
+
+const elev_t synthetic_grid::HOLE = -9999;
+
+static const double PI = acos(-1.0);
+static const int NOISE_PERIOD = 64; // Cells per lattice cell of the coarsest octave.
+static const int MAX_CONES = 32;
+static const int HOLE_BLOCK = 32; // At most one hole per block of cells.
+static const int STRIPE_ROWS = 4; // Rows per ridge of the stripes.
+
+// Hash of two integers and the seed. Used instead of rand() so grids are the same everywhere.
+static unsigned int mix(unsigned int a, unsigned int b, unsigned int seed) {
+	unsigned int h = seed ^ (a * 0x9E3779B1u) ^ (b * 0x85EBCA77u);
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	h *= 0x297A2D39u;
+	h ^= h >> 15;
+	return h;
+}
+
+// Uniform in [0;1[.
+static double unit(unsigned int h) {
+	return h / 4294967296.0;
+}
+
+synthetic_grid::synthetic_grid(terrain ter, int w, int h, unsigned int s) : t(ter), ncols(w), nrows(h), y(0), seed(s) {
+	assert(is_nodata(HOLE)); // Otherwise holes would be contoured as pits.
+	int m = min(ncols, nrows);
+	if(t == CONES) {
+		int n = min(MAX_CONES, 4 + ncols*nrows/20000);
+		for(int i = 0; i < n; i++) {
+			cone c;
+			c.x = unit(mix(i, 0, seed)) * ncols;
+			c.y = unit(mix(i, 1, seed)) * nrows;
+			c.r = (0.1 + 0.3*unit(mix(i, 2, seed))) * m;
+			c.h = 20 + 60*unit(mix(i, 3, seed));
+			cones.push_back(c);
+		}
+	}
+	// Slopes of at most a few units per cell:
+	period_x = 120 + 80*unit(mix(0, 4, seed));
+	period_y = 60 + 40*unit(mix(0, 5, seed));
+	amplitude = period_y * (0.25 + 0.15*unit(mix(0, 6, seed)));
+}
+
+double synthetic_grid::lattice(int x, int y) const {
+	return unit(mix(x, y, seed));
+}
+
+// Sum of octaves of smoothly interpolated lattice values. In [0;1[.
+double synthetic_grid::noise(double x, double y, int octaves) const {
+	double res = 0, amp = 0.5, norm = 0;
+	double f = 1.0 / NOISE_PERIOD;
+	for(int o = 0; o < octaves; o++) {
+		double fx = x*f + 1000*o, fy = y*f;
+		int ix = (int)floor(fx), iy = (int)floor(fy);
+		double dx = fx-ix, dy = fy-iy;
+		dx = dx*dx*(3-2*dx);
+		dy = dy*dy*(3-2*dy);
+		double a = lattice(ix, iy) + (lattice(ix+1, iy)-lattice(ix, iy))*dx;
+		double b = lattice(ix, iy+1) + (lattice(ix+1, iy+1)-lattice(ix, iy+1))*dx;
+		res += amp * (a + (b-a)*dy);
+		norm += amp;
+		amp *= 0.5;
+		f *= 2;
+	}
+	return res / norm;
+}
+
+elev_t synthetic_grid::at(int x, int y) const {
+	double z = 0;
+	switch(t) {
+	case FRACTAL:
+		z = 100 * noise(x, y, 6);
+		break;
+	case CONES:
+		for(vector<cone>::const_iterator it = cones.begin(); it != cones.end(); ++it) {
+			double d = sqrt((x-it->x)*(x-it->x) + (y-it->y)*(y-it->y));
+			if(d < it->r)
+				z += it->h * (1 - d/it->r);
+		}
+		z += 2 * noise(x, y, 3);
+		break;
+	case PLATEAUS: {
+		// Terraces 10 high, each sloping 2 over its width:
+		double n = 100 * noise(x, y, 4);
+		double step = 10;
+		z = floor(n/step)*step + 0.5*step + 0.2*(n - floor(n/step)*step);
+		// The hole of this or a neighbouring block:
+		int bx = x / HOLE_BLOCK, by = y / HOLE_BLOCK;
+		for(int i = bx-1; i <= bx+1; i++) {
+			for(int j = by-1; j <= by+1; j++) {
+				unsigned int h = mix(i, j, seed ^ 0x5bd1e995u);
+				if(h & 1)
+					continue;
+				double hx = (i + unit(mix(i, j, h)))*HOLE_BLOCK;
+				double hy = (j + unit(mix(j, i, h)))*HOLE_BLOCK;
+				double r = 2 + 8*unit(h);
+				if((x-hx)*(x-hx) + (y-hy)*(y-hy) < r*r)
+					return HOLE;
+			}
+		}
+		break;
+	}
+	case SERPENTINE:
+		z = 50 + 20*cos(2*PI*(y + amplitude*sin(2*PI*x/period_x))/period_y) + 4*noise(x, y, 3);
+		break;
+	case STRIPES:
+		// A flat at 50.8 with a ridge of one row up to 51.05-51.2 on every STRIPE_ROWS rows, so 
+		// with contours at every 1 and e_z 0.3 the ridges are siblings at 51 inside the one at 50.7:
+		z = 50.8 + (0.25 + 0.15*noise(x, y, 3))*max(0.0, cos(2*PI*y/STRIPE_ROWS));
+		break;
+	}
+	return (elev_t)max(0.0, min(100.0, z));
+}
+
+bool synthetic_grid::next_row(elev_t *row) {
+	if(y >= nrows)
+		return false;
+	for(int x = 0; x < ncols; x++)
+		row[x] = at(x, y);
+	y++;
+	return true;
+}
+
+bool synthetic_grid::parse(const std::string &name, terrain &res) {
+	for(int i = FRACTAL; i <= STRIPES; i++) {
+		if(name == synthetic_grid::name((terrain)i)) {
+			res = (terrain)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* synthetic_grid::name(terrain t) {
+	switch(t) {
+	case FRACTAL: return "fractal";
+	case CONES: return "cones";
+	case PLATEAUS: return "plateaus";
+	case SERPENTINE: return "serpentine";
+	case STRIPES: return "stripes";
+	}
+	return "";
+}
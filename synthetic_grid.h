@@ -0,0 +1,56 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; eval: (progn (c-set-style "stroustrup") (c-set-offset 'innamespace 0)); -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+
+#ifndef __TEST_CONTOUR_SIMPLIFICATION_SYNTHETIC_GRID_H__
+#define __TEST_CONTOUR_SIMPLIFICATION_SYNTHETIC_GRID_H__
+#include "io_contours/contour_types.h"
+#include <vector>
+#include <string>
+
+using namespace terrastream;
+
+/////////////////////////////////////////////////////////
+///
+///  A generated grid, read row by row like a grid_reader. Rows are computed when read,
+///  so grids larger than memory can be generated. The same terrain, size and seed always
+///  give the same grid. All elevations are in [0;100] except holes (see HOLE).
+///
+/////////////////////////////////////////////////////////
+class synthetic_grid {
+public:
+	enum terrain {
+		FRACTAL,    // Fractal (value) noise: Many small contours of all shapes.
+		CONES,      // Overlapping cones: Deep nesting of round contours.
+		PLATEAUS,   // Terraced noise with holes of no data: Long contours along flats and holes.
+		SERPENTINE, // Winding ridges across the grid: Few very long contours.
+		STRIPES     // Narrow parallel ridges: One family of many long siblings, so sweep lines are dense.
+	};
+	static const elev_t HOLE; // The nodata value grids are read with, so read_grid sees it as no data.
+
+	synthetic_grid(terrain t, int ncols, int nrows, unsigned int seed);
+
+	int get_ncols() const { return ncols; }
+	int get_nrows() const { return nrows; }
+	// Writes the next row to row (of size ncols). Returns false when all rows are read.
+	bool next_row(elev_t *row);
+	// Starts reading from the first row again.
+	void rewind() { y = 0; }
+
+	// Terrain by name ("fractal", "cones", "plateaus", "serpentine" or "stripes"). Returns false if unknown.
+	static bool parse(const std::string &name, terrain &t);
+	static const char* name(terrain t);
+private:
+	double noise(double x, double y, int octaves) const;
+	double lattice(int x, int y) const;
+	elev_t at(int x, int y) const;
+
+	terrain t;
+	int ncols, nrows, y;
+	unsigned int seed;
+	struct cone {
+		double x, y, r, h;
+	};
+	std::vector<cone> cones; // Cones or holes.
+	double period_x, period_y, amplitude; // Of the serpentine ridges.
+};
+#endif /*__TEST_CONTOUR_SIMPLIFICATION_SYNTHETIC_GRID_H__*/
@@ -5,6 +5,7 @@
 #define __TEST_CONTOUR_SIMPLIFICATION_UTIL_H__
 
 #include <set>
+#include <vector>
 using namespace std;
 
 template<typename T>
@@ -23,6 +24,15 @@ void print_list(std::list<T*> &s, T* ioi, int to_show) {
   }
 }
 
+template<typename T>
+void print_vector(std::vector<T*> &v) {
+  cerr << "|vector<>| = " << v.size() << endl;
+  typename vector<T*>::iterator it;
+  for (it = v.begin(); it != v.end(); ++it) {
+	cerr << " " << *(*it) << endl;
+  }
+}
+
 template<typename T>
 void print_set(std::set<T*> &s) {
   cerr << "|set<>| = " << s.size() << endl;